@@ -20,25 +20,507 @@ MODULE_AUTHOR("Danilo Dell'Orco");
  */
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
-
-ssize_t write_on_stream(const char *, size_t, object_state *);
-int schedule_write(const char *, size_t, session_state *, object_state *);
+static ssize_t dev_write(struct kiocb *, struct iov_iter *);
+static ssize_t dev_read(struct kiocb *, struct iov_iter *);
+static __poll_t dev_poll(struct file *, poll_table *);
+long set_session_param(session_state *, unsigned int, unsigned long);
+
+ssize_t write_on_stream(struct iov_iter *, size_t, object_state *, int, u64, int);
+int schedule_write(struct iov_iter *, size_t, object_state *, int, int, u64, int);
+ssize_t write_on_shard(struct iov_iter *, size_t, object_state *, int, u64, u64 *);
 void write_deferred(struct work_struct *);
 
+static void trim_flow(object_state *, flow_state *);
+static int leave_group(session_state *, int);
+static void reap_expired(struct work_struct *);
+
 static int Major;
-static int Minor;
 
 /**
  * Dobbiamo gestire 128 dispositivi di I/O, quindi 128 minor numbers differenti.
- * Definiamo un array objects che mantiene 128 differenti strutture object_state.
+ * Definiamo un array objects che mantiene 128 puntatori a strutture object_state, allocate alla prima apertura di ciascun dispositivo
+ * così che ogni dispositivo abbia il proprio stato in cache line e pagine distinte, sul nodo NUMA dei processi che lo utilizzano.
  **/
-object_state objects[NUM_DEVICES];
+object_state *objects[NUM_DEVICES];
+static DEFINE_MUTEX(objects_mutex);
+
+/**
+ * Cache slab dedicata agli stream_block: allocazioni e rilasci frequenti di oggetti della stessa dimensione.
+ */
+static struct kmem_cache *block_cache;
+
+/**
+ * Directory debugfs del modulo, contiene le statistiche complete di ciascuna classe di priorità.
+ */
+static struct dentry *debugfs_dir;
+
+/**
+ * Classe dei dispositivi del modulo, tramite cui devtmpfs ed udev creano i nodi /dev/mflow-devN.
+ */
+static struct class *mflow_class;
+
+/**
+ * Parametri di sola lettura con le statistiche dei dispositivi, calcolati al momento della lettura a partire dallo stato di ciascun dispositivo.
+ * Per compatibilità con la versione a due flussi i valori *_low si riferiscono alla classe 0, i valori *_high alla classe più prioritaria.
+ * I dispositivi mai aperti non hanno ancora uno stato e riportano 0.
+ */
+enum device_stat {
+    STAT_TOTAL_BYTES_LOW,
+    STAT_TOTAL_BYTES_HIGH,
+    STAT_WAITING_THREADS_LOW,
+    STAT_WAITING_THREADS_HIGH,
+    STAT_DEFERRED_DEPTH,
+    STAT_DEFERRED_BYTES,
+    STAT_DEFERRED_PEAK,
+    STAT_DEFERRED_THROTTLED,
+    STAT_LOCK_SPIN_ACQUIRED,
+    STAT_LOCK_SPIN_FAILED,
+    STAT_EXPIRED_BYTES,
+    STAT_COMPRESS_IN,
+    STAT_COMPRESS_OUT,
+    STAT_SPILLED_BYTES,
+    STAT_RATE_THROTTLED,
+    STAT_RATE_THROTTLED_NS,
+    STAT_PREEMPTED_BYTES,
+    NUM_STATS
+};
+static int stat_ids[NUM_STATS] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+static unsigned long get_device_stat(object_state *the_object, int stat) {
+    int i;
+    unsigned long sum = 0;
+    flow_state *lowest = &the_object->priority_flow[0];
+    flow_state *highest = &the_object->priority_flow[the_object->num_flows - 1];
+
+    switch (stat) {
+        case STAT_TOTAL_BYTES_LOW:
+            return READ_ONCE(lowest->total_bytes) + flow_staged_bytes(lowest);
+        case STAT_TOTAL_BYTES_HIGH:
+            return READ_ONCE(highest->total_bytes) + flow_staged_bytes(highest);
+        case STAT_WAITING_THREADS_LOW:
+            return READ_ONCE(lowest->waiting_threads);
+        case STAT_WAITING_THREADS_HIGH:
+            return READ_ONCE(highest->waiting_threads);
+        case STAT_DEFERRED_DEPTH:
+            return atomic_long_read(&the_object->deferred_depth);
+        case STAT_DEFERRED_BYTES:
+            return atomic_long_read(&the_object->deferred_bytes);
+        case STAT_DEFERRED_PEAK:
+            return READ_ONCE(the_object->deferred_peak);
+        case STAT_DEFERRED_THROTTLED:
+            return atomic_long_read(&the_object->deferred_throttled);
+        case STAT_LOCK_SPIN_ACQUIRED:
+            for (i = 0; i < the_object->num_flows; i++) {
+                sum += atomic_long_read(&the_object->priority_flow[i].spin_acquired);
+            }
+            return sum;
+        case STAT_LOCK_SPIN_FAILED:
+            for (i = 0; i < the_object->num_flows; i++) {
+                sum += atomic_long_read(&the_object->priority_flow[i].spin_failed);
+            }
+            return sum;
+        case STAT_EXPIRED_BYTES:
+            for (i = 0; i < the_object->num_flows; i++) {
+                sum += READ_ONCE(the_object->priority_flow[i].expired_bytes);
+            }
+            return sum;
+        case STAT_COMPRESS_IN:
+            return READ_ONCE(the_object->compress_in);
+        case STAT_COMPRESS_OUT:
+            return READ_ONCE(the_object->compress_out);
+        case STAT_SPILLED_BYTES:
+            for (i = 0; i < the_object->num_flows; i++) {
+                sum += READ_ONCE(the_object->priority_flow[i].spill_bytes);
+            }
+            return sum;
+        case STAT_RATE_THROTTLED:
+            return atomic_long_read(&the_object->rate.throttled);
+        case STAT_RATE_THROTTLED_NS:
+            return atomic64_read(&the_object->rate.throttled_ns);
+        case STAT_PREEMPTED_BYTES:
+            for (i = 0; i < the_object->num_flows; i++) {
+                sum += READ_ONCE(the_object->priority_flow[i].preempted_bytes);
+            }
+            return sum;
+    }
+    return 0;
+}
+
+static int get_device_stats(char *buffer, const struct kernel_param *kp) {
+    int i;
+    int len = 0;
+    int stat = *(int *)kp->arg;
+    object_state *the_object;
+
+    for (i = 0; i < NUM_DEVICES; i++) {
+        the_object = smp_load_acquire(&objects[i]);
+        len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%lu", i ? "," : "", the_object ? get_device_stat(the_object, stat) : 0);
+    }
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+static const struct kernel_param_ops device_stat_ops = {.get = get_device_stats};
+
+module_param_cb(total_bytes_low, &device_stat_ops, &stat_ids[STAT_TOTAL_BYTES_LOW], 0440);
+MODULE_PARM_DESC(total_bytes_low, "Bytes present in the lowest priority class of each device.");
+module_param_cb(total_bytes_high, &device_stat_ops, &stat_ids[STAT_TOTAL_BYTES_HIGH], 0440);
+MODULE_PARM_DESC(total_bytes_high, "Bytes present in the highest priority class of each device.");
+module_param_cb(waiting_threads_low, &device_stat_ops, &stat_ids[STAT_WAITING_THREADS_LOW], 0440);
+MODULE_PARM_DESC(waiting_threads_low, "Threads waiting on the lowest priority class of each device.");
+module_param_cb(waiting_threads_high, &device_stat_ops, &stat_ids[STAT_WAITING_THREADS_HIGH], 0440);
+MODULE_PARM_DESC(waiting_threads_high, "Threads waiting on the highest priority class of each device.");
+module_param_cb(deferred_queue_depth, &device_stat_ops, &stat_ids[STAT_DEFERRED_DEPTH], 0440);
+MODULE_PARM_DESC(deferred_queue_depth, "Number of deferred writes not yet appended to the deferred flows.");
+module_param_cb(deferred_queue_bytes, &device_stat_ops, &stat_ids[STAT_DEFERRED_BYTES], 0440);
+MODULE_PARM_DESC(deferred_queue_bytes, "Number of bytes held by deferred writes not yet appended to the deferred flows.");
+module_param_cb(deferred_queue_peak, &device_stat_ops, &stat_ids[STAT_DEFERRED_PEAK], 0440);
+MODULE_PARM_DESC(deferred_queue_peak, "Maximum number of deferred writes pending at the same time on the deferred flows.");
+module_param_cb(deferred_throttled, &device_stat_ops, &stat_ids[STAT_DEFERRED_THROTTLED], 0440);
+MODULE_PARM_DESC(deferred_throttled, "Number of deferred writes delayed or rejected because the deferred queue was full.");
+module_param_cb(lock_spin_acquired, &device_stat_ops, &stat_ids[STAT_LOCK_SPIN_ACQUIRED], 0440);
+MODULE_PARM_DESC(lock_spin_acquired, "Number of blocking lock acquisitions completed by spinning, without sleeping.");
+module_param_cb(lock_spin_failed, &device_stat_ops, &stat_ids[STAT_LOCK_SPIN_FAILED], 0440);
+MODULE_PARM_DESC(lock_spin_failed, "Number of blocking lock acquisitions that spun without success and then slept.");
+module_param_cb(expired_bytes, &device_stat_ops, &stat_ids[STAT_EXPIRED_BYTES], 0440);
+MODULE_PARM_DESC(expired_bytes, "Number of bytes discarded unread because they were older than flow_ttl_ms.");
+module_param_cb(deferred_compressed_in, &device_stat_ops, &stat_ids[STAT_COMPRESS_IN], 0440);
+MODULE_PARM_DESC(deferred_compressed_in, "Bytes of deferred writes stored compressed, before compression.");
+module_param_cb(deferred_compressed_out, &device_stat_ops, &stat_ids[STAT_COMPRESS_OUT], 0440);
+MODULE_PARM_DESC(deferred_compressed_out, "Bytes of deferred writes stored compressed, after compression.");
+module_param_cb(spilled_bytes, &device_stat_ops, &stat_ids[STAT_SPILLED_BYTES], 0440);
+MODULE_PARM_DESC(spilled_bytes, "Bytes of each device currently held in the spill files instead of kernel memory.");
+module_param_cb(rate_throttled, &device_stat_ops, &stat_ids[STAT_RATE_THROTTLED], 0440);
+MODULE_PARM_DESC(rate_throttled, "Number of reads and writes delayed or rejected by the session or device rate limits.");
+module_param_cb(rate_throttled_ns, &device_stat_ops, &stat_ids[STAT_RATE_THROTTLED_NS], 0440);
+MODULE_PARM_DESC(rate_throttled_ns, "Nanoseconds spent waiting by reads and writes delayed by the session or device rate limits.");
+module_param_cb(preempted_bytes, &device_stat_ops, &stat_ids[STAT_PREEMPTED_BYTES], 0440);
+MODULE_PARM_DESC(preempted_bytes, "Number of bytes of lower priority classes discarded unread to make room for higher priority writes.");
+
+/**
+ * Contenuto del file debugfs 'flows': una riga per ciascuna classe di priorità dei dispositivi in uso.
+ */
+static int flows_show(struct seq_file *m, void *v) {
+    int i, j;
+    object_state *the_object;
+    flow_state *the_flow;
+
+    seq_printf(m, "minor class mode total_bytes ready_bytes waiting_threads submitted_seq completed_seq spin_acquired spin_failed expired_bytes spill_bytes preempted_bytes\n");
+    for (i = 0; i < NUM_DEVICES; i++) {
+        the_object = smp_load_acquire(&objects[i]);
+        if (the_object == NULL) continue;
+        for (j = 0; j < the_object->num_flows; j++) {
+            the_flow = &the_object->priority_flow[j];
+            if (flow_submitted_seq(the_flow) == 0 && READ_ONCE(the_flow->waiting_threads) == 0) continue;
+            seq_printf(m, "%d %d %s %lu %lu %lu %llu %llu %ld %ld %lu %lu %lu\n", i, j,
+                       flow_mode[j] == DEFERRED_WRITE ? "deferred" : (the_flow->shards != NULL ? "sharded" : "sync"),
+                       READ_ONCE(the_flow->total_bytes) + flow_staged_bytes(the_flow), flow_ready_bytes(the_flow),
+                       READ_ONCE(the_flow->waiting_threads), flow_submitted_seq(the_flow), flow_completed_seq(the_flow),
+                       atomic_long_read(&the_flow->spin_acquired), atomic_long_read(&the_flow->spin_failed), READ_ONCE(the_flow->expired_bytes), READ_ONCE(the_flow->spill_bytes),
+                       READ_ONCE(the_flow->preempted_bytes));
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(flows);
+
+/**
+ * Mostra i consumer group di ciascun flusso: sessioni nel gruppo, posizione del cursore, bytes ancora da leggere e bytes scartati.
+ * I valori sono letti senza lock, quindi sono solo indicativi.
+ */
+static int groups_show(struct seq_file *m, void *v) {
+    int i, j, k;
+    object_state *the_object;
+    flow_state *the_flow;
+    consumer_group *group;
+
+    seq_printf(m, "minor class group members pos lag dropped\n");
+    for (i = 0; i < NUM_DEVICES; i++) {
+        the_object = smp_load_acquire(&objects[i]);
+        if (the_object == NULL) continue;
+        for (j = 0; j < the_object->num_flows; j++) {
+            the_flow = &the_object->priority_flow[j];
+            for (k = 0; k < MAX_GROUPS; k++) {
+                group = &the_flow->groups[k];
+                if (READ_ONCE(group->members) == 0) continue;
+                seq_printf(m, "%d %d %s %d %llu %lu %lu\n", i, j, group->name, READ_ONCE(group->members), READ_ONCE(group->pos),
+                           group_ready_bytes(the_flow, group), READ_ONCE(group->dropped));
+            }
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(groups);
+
+/**
+ * Stampa una riga del file 'latency': numero di campioni, limite superiore in ns dei bucket che contengono il 50°, 99° e 99.9° percentile,
+ * e l'elenco dei bucket non vuoti nel formato <limite inferiore in ns>:<campioni>.
+ */
+static void latency_show_hist(struct seq_file *m, int minor, int class, const char *kind, unsigned long *hist) {
+    int k, p;
+    unsigned long counts[LAT_BUCKETS];
+    unsigned long samples = 0;
+    unsigned long seen = 0;
+    static const int permille[] = {500, 990, 999};
+
+    for (k = 0; k < LAT_BUCKETS; k++) {
+        counts[k] = READ_ONCE(hist[k]);
+        samples += counts[k];
+    }
+    if (samples == 0) return;
+
+    seq_printf(m, "%d %d %s %lu", minor, class, kind, samples);
+    for (p = 0, k = 0; p < ARRAY_SIZE(permille); p++) {
+        while (k < LAT_BUCKETS - 1 && (seen + counts[k]) * 1000 < samples * permille[p]) {
+            seen += counts[k++];
+        }
+        seq_printf(m, " %llu", 1ULL << k);
+    }
+    for (k = 0; k < LAT_BUCKETS; k++) {
+        if (counts[k] != 0) seq_printf(m, " %llu:%lu", k == 0 ? 0ULL : 1ULL << (k - 1), counts[k]);
+    }
+    seq_putc(m, '\n');
+}
+
+/**
+ * Contenuto del file debugfs 'latency': per ciascuna classe di priorità gli istogrammi logaritmici della latenza submit→visible
+ * (attesa del lock e della coda deferred) e visible→read (permanenza nello stream fino alla lettura completa di ogni blocco, per ciascun cursore).
+ * I valori sono letti senza lock, quindi sono solo indicativi.
+ */
+static int latency_show(struct seq_file *m, void *v) {
+    int i, j;
+    object_state *the_object;
+    flow_state *the_flow;
+
+    seq_printf(m, "minor class kind samples p50_ns p99_ns p999_ns buckets\n");
+    for (i = 0; i < NUM_DEVICES; i++) {
+        the_object = smp_load_acquire(&objects[i]);
+        if (the_object == NULL) continue;
+        for (j = 0; j < the_object->num_flows; j++) {
+            the_flow = &the_object->priority_flow[j];
+            latency_show_hist(m, i, j, "submit_visible", the_flow->visible_hist);
+            latency_show_hist(m, i, j, "visible_read", the_flow->read_hist);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/**
+ * Dealloca una lista di blocchi, insieme ai relativi dati.
+ */
+static void free_blocks(stream_block *current_block) {
+    stream_block *next_block;
+    while (current_block != NULL) {
+        next_block = current_block->next;
+        free_block_data(current_block);
+        kmem_cache_free(block_cache, current_block);
+        current_block = next_block;
+    }
+}
+
+/**
+ * Rilascia tutte le risorse di un dispositivo. Le strutture non ancora allocate sono a NULL, quindi vengono semplicemente saltate.
+ * La workqueue viene distrutta per prima, attendendo il completamento delle scritture deferred ancora in coda, così che nessuna
+ * write_deferred possa accedere ai flussi mentre vengono deallocati.
+ */
+static void release_object(object_state *the_object) {
+    int j, cpu;
+
+    if (the_object == NULL) {
+        return;
+    }
+    cancel_delayed_work_sync(&the_object->reaper);
+    if (the_object->deferred_wq != NULL) {
+        destroy_workqueue(the_object->deferred_wq);
+    }
+    for (j = 0; j < MAX_FLOWS; j++) {
+        flow_state *object_flow = &the_object->priority_flow[j];
+
+        // Deallocazione di tutti i blocchi dati dello stream, compresi quelli trattenuti per i consumer group ed il blocco vuoto in coda.
+        free_blocks(object_flow->retained);
+
+        // Deallocazione dei blocchi ancora accodati negli shard di un flusso sharded
+        if (object_flow->shards != NULL) {
+            for_each_possible_cpu(cpu) {
+                free_blocks(per_cpu_ptr(object_flow->shards, cpu)->head);
+            }
+            free_percpu(object_flow->shards);
+        }
+        free_blocks(object_flow->pending);
+        if (object_flow->spill_file != NULL) {
+            fput(object_flow->spill_file);
+        }
+    }
+    kvfree(the_object->lz4_wrkmem);
+    kfree(the_object);
+}
+
+/**
+ * Ritorna lo stato del dispositivo, allocandolo alla prima apertura. Lo stato viene allocato sul nodo NUMA configurato tramite il parametro
+ * device_node, oppure sul nodo della CPU del primo processo che apre il dispositivo. Ritorna NULL se l'allocazione fallisce.
+ */
+static object_state *get_object(int minor) {
+    int j, cpu, node;
+    object_state *the_object = smp_load_acquire(&objects[minor]);
+
+    if (the_object != NULL) {
+        return the_object;
+    }
+
+    mutex_lock(&objects_mutex);
+    the_object = objects[minor];
+    if (the_object != NULL) {
+        goto out;
+    }
+
+    node = (device_node >= 0 && device_node < MAX_NUMNODES && node_online(device_node)) ? device_node : numa_node_id();
+    the_object = kzalloc_node(sizeof(object_state), GFP_KERNEL, node);
+    if (the_object == NULL) {
+        goto out;
+    }
+    the_object->node = node;
+    the_object->num_flows = device_flows[minor];
+    INIT_DELAYED_WORK(&the_object->reaper, reap_expired);
+    spin_lock_init(&the_object->rate.lock);
+
+    for (j = 0; j < the_object->num_flows; j++) {
+        flow_state *object_flow = &the_object->priority_flow[j];
+        mutex_init(&(object_flow->operation_synchronizer));
+        INIT_LIST_HEAD(&object_flow->deferred);
+
+        // Inizializzazione della waitqueue
+        init_waitqueue_head(&object_flow->wait_queue);
+
+        // Allocazione per il primo blocco dello stream
+        object_flow->head = kmem_cache_alloc_node(block_cache, GFP_KERNEL | __GFP_ZERO, node);
+        if (object_flow->head == NULL) goto revert_allocation;
+        object_flow->head->id = 0;
+        object_flow->tail = object_flow->head;
+        object_flow->head->next = NULL;
+        object_flow->head->stream_content = NULL;
+        object_flow->head->read_offset = 0;
+        object_flow->retained = object_flow->head;
+
+        // Buffer di sottomissione per-CPU, solo per le classi sincrone che li richiedono
+        if (flow_sharded[j] && flow_mode[j] == SYNC_WRITE) {
+            object_flow->shards = alloc_percpu(flow_shard);
+            if (object_flow->shards == NULL) goto revert_allocation;
+            for_each_possible_cpu(cpu) {
+                spin_lock_init(&per_cpu_ptr(object_flow->shards, cpu)->lock);
+            }
+        }
+    }
+
+    // Waitqueue dei lettori in attesa di dati su uno qualsiasi dei flussi
+    init_waitqueue_head(&the_object->data_queue);
+
+    // Workqueue ordinata per le scritture deferred del dispositivo
+    the_object->deferred_wq = alloc_ordered_workqueue("mflow-deferred-%d", 0, minor);
+    if (the_object->deferred_wq == NULL) goto revert_allocation;
+
+    atomic_long_set(&the_object->available_bytes, MAX_SIZE_BYTES);
+
+    // Lo stato viene pubblicato solo dopo essere stato inizializzato completamente.
+    smp_store_release(&objects[minor], the_object);
+    printk(KERN_INFO "%s: Object State of device %d allocated on node %d.\n", MODNAME, minor, node);
+
+out:
+    mutex_unlock(&objects_mutex);
+    return the_object;
+
+revert_allocation:
+    printk(KERN_INFO "%s: Error allocating device %d. Revert allocation\n", MODNAME, minor);
+    release_object(the_object);
+    the_object = NULL;
+    goto out;
+}
+
+// ---------------------------------------- LOW-WATERMARK WAKEUPS --------------------------------------------
+/**
+ * Avvia il timer di max-delay della sessione, se non è già in corso. Viene invocata quando arrivano dati sotto il low-watermark.
+ */
+static void arm_delay(session_state *session) {
+    if (session->max_delay > 0 && !test_and_set_bit(DELAY_ARMED, &session->delay_flags)) {
+        hrtimer_start(&session->delay_timer, ms_to_ktime(session->max_delay), HRTIMER_MODE_REL);
+    }
+}
+
+/**
+ * Allo scadere del max-delay i dati in coda vengono notificati alla sessione anche se sotto il low-watermark.
+ */
+static enum hrtimer_restart delay_expired(struct hrtimer *timer) {
+    session_state *session = container_of(timer, session_state, delay_timer);
+    set_bit(DELAY_EXPIRED, &session->delay_flags);
+    wake_up(&session->poll_queue);
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * Funzione di risveglio del relay, invocata dalla notify_data dei writer con il lock della data_queue acquisito.
+ * La poll_queue della sessione viene risvegliata solo se la soglia è stata raggiunta, altrimenti viene avviato il timer di max-delay:
+ * così i lettori bloccanti e la poll() non vengono risvegliati ad ogni singolo messaggio.
+ */
+static int relay_wake(wait_queue_entry_t *wait, unsigned int mode, int flags, void *key) {
+    session_state *session = container_of(wait, session_state, relay);
+    object_state *the_object = objects[session->minor];
+
+    if (session_data_ready(the_object, session)) {
+        wake_up(&session->poll_queue);
+    } else if (session_has_data(the_object, session)) {
+        arm_delay(session);
+    }
+    return 0;
+}
+
+/**
+ * Registra o rimuove il relay della sessione dalla data_queue del dispositivo, in base alle soglie impostate.
+ * Le attese in corso vengono risvegliate, così da ricontrollare la condizione con le nuove soglie.
+ * Va invocata con relay_lock acquisito, insieme alla modifica di rcvlowat e max_delay: due ioctl concorrenti sulla stessa sessione
+ * potrebbero altrimenti registrare due volte il relay, oppure lasciarlo registrato con entrambe le soglie azzerate.
+ */
+static void update_relay(session_state *session) {
+    object_state *the_object = objects[session->minor];
+    int needed = session->rcvlowat > 1 || session->max_delay > 0;
+
+    lockdep_assert_held(&session->relay_lock);
+
+    if (needed && !session->relay_active) {
+        init_waitqueue_func_entry(&session->relay, relay_wake);
+        add_wait_queue(&the_object->data_queue, &session->relay);
+        WRITE_ONCE(session->relay_active, 1);
+    } else if (!needed && session->relay_active) {
+        WRITE_ONCE(session->relay_active, 0);
+        remove_wait_queue(&the_object->data_queue, &session->relay);
+        hrtimer_cancel(&session->delay_timer);
+        session->delay_flags = 0;
+    }
+    wake_up(&session->poll_queue);
+    notify_data(the_object);
+}
+
+/**
+ * Dopo una lettura il max-delay riparte da zero: se restano in coda dati sotto il low-watermark il timer viene riavviato.
+ */
+static void session_consumed(session_state *session) {
+    object_state *the_object = objects[session->minor];
+
+    if (!session->relay_active) {
+        return;
+    }
+    hrtimer_try_to_cancel(&session->delay_timer);
+    clear_bit(DELAY_EXPIRED, &session->delay_flags);
+    clear_bit(DELAY_ARMED, &session->delay_flags);
+    if (session_has_data(the_object, session) && !session_data_ready(the_object, session)) {
+        arm_delay(session);
+    }
+}
 
 /*
  * Invocata dal VFS quando viene aperto il nodo associato al driver.
  */
 static int dev_open(struct inode *inode, struct file *file) {
+    int Minor;
     session_state *session;
 
     printk("%s: ------------------------------------- OPEN -------------------------------------------\n", MODNAME);
@@ -51,20 +533,38 @@ static int dev_open(struct inode *inode, struct file *file) {
 
     if (device_enabling[Minor] == DISABLED) {
         printk("%s: device with minor %d is disabled, and cannot be opened.\n", MODNAME, Minor);
-        return OPEN_ERROR;
+        return DEV_DISABLED;
+    }
+
+    // Lo stato del dispositivo viene allocato alla prima apertura, sul nodo NUMA del processo corrente.
+    if (get_object(Minor) == NULL) {
+        printk("%s: unable to allocate the state of device %d\n", MODNAME, Minor);
+        return ALLOC_ERROR;
     }
 
     session = kzalloc(sizeof(session_state), GFP_ATOMIC);
     if (session == NULL) {
         printk("%s: kzalloc error, unable to allocate session\n", MODNAME);
-        return OPEN_ERROR;
+        return ALLOC_ERROR;
     }
 
-    // Parametri di default per la nuova sessione
-    session->priority = HIGH_PRIORITY;
+    // Parametri di default per la nuova sessione. La priorità di default è la classe più prioritaria del dispositivo.
+    session->priority = objects[Minor]->num_flows - 1;
     session->blocking = NON_BLOCKING;
     session->timeout = 0;
+    session->minor = Minor;
+    session->group = -1;
+    init_waitqueue_head(&session->poll_queue);
+    mutex_init(&session->relay_lock);
+    setup_rel_hrtimer(&session->delay_timer, delay_expired);
+    spin_lock_init(&session->rate.lock);
     file->private_data = session;
+
+    // Le operazioni di read/write non si bloccano mai se viene richiesto IOCB_NOWAIT, quindi il file può essere usato da io_uring
+    // senza passare per i thread di io-wq.
+#ifdef FMODE_NOWAIT
+    file->f_mode |= FMODE_NOWAIT;
+#endif
     printk(KERN_INFO "%s: Session state %d correctly allocated.\n", MODNAME, current->pid);
 
     printk("%s: Process %d successfully opened the device file with Minor %d\n", MODNAME, current->pid, Minor);
@@ -72,451 +572,2275 @@ static int dev_open(struct inode *inode, struct file *file) {
 }
 
 /**
- * Invocata dal VFS quando si chiude il file.
+ * Invocata dal VFS quando si chiude il file.
+ */
+static int dev_release(struct inode *inode, struct file *file) {
+    int Minor = get_minor(file);
+    session_state *session = file->private_data;
+    printk("%s: ------------------------------------- CLOSE -------------------------------------------\n", MODNAME);
+
+    // Il relay viene rimosso dalla data_queue del dispositivo prima di deallocare la sessione
+    mutex_lock(&session->relay_lock);
+    session->rcvlowat = 0;
+    session->max_delay = 0;
+    update_relay(session);
+    mutex_unlock(&session->relay_lock);
+    leave_group(session, 0);
+
+    kfree(file->private_data);
+    printk(KERN_INFO "%s: Session state %d correctly deallocated.\n", MODNAME, current->pid);
+    printk("%s: Device file %d closed by process %d\n", MODNAME, Minor, current->pid);
+    return 0;
+}
+
+// ------------------------------------------ CONSUMER GROUPS ----------------------------------------------
+/**
+ * Verifica se il cursore di un consumer group del flusso punta al blocco indicato.
+ */
+static int block_in_use(flow_state *the_flow, stream_block *block) {
+    int i;
+    for (i = 0; i < MAX_GROUPS; i++) {
+        if (the_flow->groups[i].members > 0 && the_flow->groups[i].block == block) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Con la politica LAG_DROP scarta per il gruppo i dati più vecchi, finché il suo ritardo non rientra in group_max_lag.
+ * I dati vengono scartati a blocchi interi, così che il gruppo non riceva mai una scrittura troncata.
+ */
+static void drop_group_data(flow_state *the_flow, consumer_group *group) {
+    size_t skipped;
+    unsigned long max_lag = READ_ONCE(group_max_lag);
+
+    while (the_flow->tail_pos - group->pos > max_lag && group->block->next != NULL) {
+        skipped = group->block->size - group->offset;
+        group->dropped += skipped;
+        group->block = group->block->next;
+        group->offset = 0;
+        WRITE_ONCE(group->pos, group->pos + skipped);
+    }
+}
+
+/**
+ * Rilascia i dati già letti sia dai lettori distruttivi che da tutti i consumer group del flusso. Va invocata possedendo il lock del flusso,
+ * ogni volta che avanza uno dei cursori o che vengono aggiunti dati con la politica LAG_DROP.
+ * Lo spazio del dispositivo viene restituito fino alla posizione del cursore più arretrato, mentre i blocchi vengono deallocati solo quando
+ * nessun cursore vi punta più. Senza consumer group il cursore più arretrato è quello dei lettori distruttivi, come in una normale lettura.
+ */
+static void trim_flow(object_state *the_object, flow_state *the_flow) {
+    int i;
+    u64 min_pos = the_flow->head_pos;
+    stream_block *block;
+    consumer_group *group;
+
+    for (i = 0; i < MAX_GROUPS; i++) {
+        group = &the_flow->groups[i];
+        if (group->members == 0) {
+            continue;
+        }
+        if (READ_ONCE(group_lag_policy) == LAG_DROP && READ_ONCE(group_max_lag) > 0) {
+            drop_group_data(the_flow, group);
+        }
+        min_pos = min(min_pos, group->pos);
+    }
+
+    if (min_pos > the_flow->released_pos) {
+        release_space(the_object, min_pos - the_flow->released_pos);
+        the_flow->released_pos = min_pos;
+    }
+
+    while (the_flow->retained != the_flow->head && !block_in_use(the_flow, the_flow->retained)) {
+        block = the_flow->retained;
+        the_flow->retained = block->next;
+        // Un blocco scartato senza essere letto, ancora compresso o nel file di spill, occupava meno spazio di quello già rilasciato in base alle posizioni
+        if (block_charge(block) < block->size) {
+            atomic_long_sub(block->size - block_charge(block), &the_object->available_bytes);
+        }
+        if (block->spilled) {
+            WRITE_ONCE(the_flow->spill_bytes, the_flow->spill_bytes - block->size);
+            spill_discard(the_flow, block->spill_pos, block->spill_pos + block_data_bytes(block));
+        }
+        free_block_data(block);
+        kmem_cache_free(block_cache, block);
+    }
+}
+
+/**
+ * Acquisisce il lock del flusso 'priority' per modificarne i consumer group. Da una ioctl ('interruptible') l'attesa termina alla scadenza
+ * della sessione (timeout o deadline_ns) con LOCK_TIMEOUT, oppure, se la sessione non ne ha, non ha limiti di tempo ma viene interrotta
+ * da un segnale con -EINTR: un task in attesa di un lock trattenuto a lungo resta così terminabile.
+ */
+static int group_lock(session_state *session, int priority, int interruptible) {
+    object_state *the_object = objects[session->minor];
+    ktime_t deadline;
+
+    if (!interruptible) {
+        return get_lock(the_object, session->minor, priority, BLOCKING, 0, LOCK);
+    }
+    deadline = get_deadline(session);
+    if (deadline != 0) {
+        return get_lock(the_object, session->minor, priority, BLOCKING, deadline, TRYLOCK);
+    }
+    return get_lock(the_object, session->minor, priority, BLOCKING, 0, LOCK_INTERRUPTIBLE);
+}
+
+/**
+ * Inserisce la sessione nel consumer group con il nome indicato, sul flusso selezionato dalla priorità della sessione. Il gruppo viene creato
+ * al primo ingresso, con il cursore sulla coda del flusso: riceve quindi solo i dati scritti da quel momento in poi. Le sessioni dello stesso
+ * gruppo condividono il cursore, e ciascun dato viene letto da una sola di esse.
+ * Ritorna 0, -EINVAL se il nome non è valido, -EBUSY se il flusso ha già MAX_GROUPS gruppi o -EFAULT se il nome non è leggibile,
+ * oppure l'errore dell'attesa del lock del flusso (group_lock).
+ */
+static long join_group(session_state *session, const char __user *uname) {
+    int i, ret;
+    int slot = -1;
+    long len;
+    char name[MFLOW_GROUP_NAME_LEN];
+    object_state *the_object = objects[session->minor];
+    flow_state *the_flow = &the_object->priority_flow[session->priority];
+    consumer_group *group;
+
+    len = strncpy_from_user(name, uname, sizeof(name));
+    if (len < 0) {
+        return COPY_ERROR;
+    }
+    if (len == 0 || len == sizeof(name)) {
+        return -EINVAL;
+    }
+
+    ret = leave_group(session, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = group_lock(session, session->priority, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < MAX_GROUPS && slot < 0; i++) {
+        if (the_flow->groups[i].members > 0 && strcmp(the_flow->groups[i].name, name) == 0) {
+            slot = i;
+        }
+    }
+    for (i = 0; i < MAX_GROUPS && slot < 0; i++) {
+        if (the_flow->groups[i].members == 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        release_lock(the_flow);
+        return -EBUSY;
+    }
+
+    group = &the_flow->groups[slot];
+    if (group->members == 0) {
+        strscpy(group->name, name, sizeof(group->name));
+        group->block = the_flow->tail;
+        group->offset = 0;
+        group->dropped = 0;
+        WRITE_ONCE(group->pos, the_flow->tail_pos);
+    }
+    WRITE_ONCE(group->members, group->members + 1);
+    session->group = slot;
+    session->group_flow = session->priority;
+    release_lock(the_flow);
+
+    printk("%s: thread %d joined the consumer group '%s' of the %s flow on [%d,%d]\n", MODNAME, current->pid, name, get_prio_str(session->group_flow), Major, session->minor);
+    return 0;
+}
+
+/**
+ * Rimuove la sessione dal proprio consumer group. Quando l'ultima sessione esce il gruppo viene eliminato,
+ * ed i dati trattenuti soltanto per il gruppo vengono rilasciati. Con 'interruptible' l'attesa del lock segue la group_lock,
+ * altrimenti (chiusura della sessione) il lock viene sempre atteso. Ritorna 0 oppure l'errore dell'attesa del lock.
+ */
+static int leave_group(session_state *session, int interruptible) {
+    object_state *the_object = objects[session->minor];
+    flow_state *the_flow;
+    consumer_group *group;
+    int ret;
+
+    if (session->group < 0) {
+        return 0;
+    }
+    the_flow = &the_object->priority_flow[session->group_flow];
+    group = &the_flow->groups[session->group];
+
+    ret = group_lock(session, session->group_flow, interruptible);
+    if (ret < 0) {
+        return ret;
+    }
+    WRITE_ONCE(group->members, group->members - 1);
+    if (group->members == 0) {
+        group->block = NULL;
+        trim_flow(the_object, the_flow);
+    }
+    release_lock(the_flow);
+    session->group = -1;
+    notify_space(the_object);
+    return 0;
+}
+
+// ------------------------------------------- TTL EXPIRY ------------------------------------------------
+/**
+ * Scarta i dati del flusso resi visibili da più di flow_ttl_ms millisecondi, per tutti i cursori che non li hanno ancora letti:
+ * i lettori distruttivi ed i consumer group saltano i blocchi scaduti a partire dai più vecchi, e lo spazio viene rilasciato dalla trim_flow.
+ * Va invocata possedendo il lock del flusso. Ritorna il numero di bytes scartati.
+ */
+static unsigned long expire_flow(object_state *the_object, flow_state *the_flow, int priority) {
+    int i;
+    size_t skipped;
+    unsigned long expired = 0;
+    unsigned long dropped = 0;
+    u64 ttl = (u64)READ_ONCE(flow_ttl_ms[priority]) * NSEC_PER_MSEC;
+    u64 now = ktime_get_ns();
+    stream_block *block;
+    consumer_group *group;
+
+    if (ttl == 0) {
+        return 0;
+    }
+
+    // Lettori distruttivi: si sposta la testa dello stream oltre i blocchi scaduti, come in una lettura
+    for (block = the_flow->head; block->next != NULL && now - block->visible_ns > ttl; block = block->next) {
+        expired += block->size - block->read_offset;
+        block->read_offset = block->size;
+    }
+    the_flow->head = block;
+    the_flow->total_bytes -= expired;
+    the_flow->ready_bytes -= expired;
+    the_flow->head_pos += expired;
+    WRITE_ONCE(the_flow->expired_bytes, the_flow->expired_bytes + expired);
+
+    // Consumer group: i bytes saltati vengono conteggiati tra quelli scartati per il gruppo
+    for (i = 0; i < MAX_GROUPS; i++) {
+        group = &the_flow->groups[i];
+        if (group->members == 0) {
+            continue;
+        }
+        while (group->block->next != NULL && now - group->block->visible_ns > ttl) {
+            skipped = group->block->size - group->offset;
+            group->dropped += skipped;
+            dropped += skipped;
+            group->block = group->block->next;
+            group->offset = 0;
+            WRITE_ONCE(group->pos, group->pos + skipped);
+        }
+    }
+
+    if (expired + dropped > 0) {
+        printk("%s: %lu expired bytes discarded from the %s flow\n", MODNAME, expired + dropped, get_prio_str(priority));
+        trim_flow(the_object, the_flow);
+        notify_space(the_object);
+    }
+    return expired + dropped;
+}
+
+/**
+ * Scarta i dati scaduti di tutti i flussi del dispositivo, per liberare spazio per una scrittura che non ne trova. Il lock del flusso 'held'
+ * è già posseduto dal chiamante (-1 se nessuno), mentre quelli degli altri flussi vengono acquisiti solo se liberi: non si attende mai
+ * un lock possedendone un altro. Ritorna il numero di bytes scartati.
+ */
+static unsigned long reclaim_expired(object_state *the_object, int held) {
+    int j;
+    unsigned long expired = 0;
+    flow_state *the_flow;
+
+    for (j = 0; j < the_object->num_flows; j++) {
+        if (READ_ONCE(flow_ttl_ms[j]) == 0) {
+            continue;
+        }
+        the_flow = &the_object->priority_flow[j];
+        if (j == held) {
+            expired += expire_flow(the_object, the_flow, j);
+        } else if (mutex_trylock(&the_flow->operation_synchronizer)) {
+            WRITE_ONCE(the_flow->lock_owner, current);
+            expired += expire_flow(the_object, the_flow, j);
+            release_lock(the_flow);
+        }
+    }
+    return expired;
+}
+
+/**
+ * Avvia il reaper del dispositivo dopo una scrittura su un flusso con TTL, se non è già in attesa. Il reaper scade insieme ai dati appena scritti,
+ * e si riprogramma da solo finché nei flussi con TTL restano dati.
+ */
+static void arm_reaper(object_state *the_object, int priority) {
+    unsigned long ttl = READ_ONCE(flow_ttl_ms[priority]);
+
+    if (ttl > 0 && !delayed_work_pending(&the_object->reaper)) {
+        queue_delayed_work(system_wq, &the_object->reaper, msecs_to_jiffies(ttl) + 1);
+    }
+}
+
+/**
+ * Reaper del dispositivo: scarta i dati scaduti anche se nessuno legge o scrive sul flusso, così che lo spazio occupato dai dati vecchi
+ * torni disponibile alle altre classi. Viene riprogrammato alla scadenza del blocco più vecchio ancora presente nei flussi con TTL.
+ */
+static void reap_expired(struct work_struct *work) {
+    int j;
+    u64 ttl;
+    u64 now;
+    u64 next = U64_MAX;
+    flow_state *the_flow;
+    object_state *the_object = container_of(to_delayed_work(work), object_state, reaper);
+
+    for (j = 0; j < the_object->num_flows; j++) {
+        ttl = (u64)READ_ONCE(flow_ttl_ms[j]) * NSEC_PER_MSEC;
+        if (ttl == 0) {
+            continue;
+        }
+        the_flow = &the_object->priority_flow[j];
+        mutex_lock(&the_flow->operation_synchronizer);
+        WRITE_ONCE(the_flow->lock_owner, current);
+        expire_flow(the_object, the_flow, j);
+
+        // Il blocco più vecchio ancora nello stream è il prossimo a scadere. Le scritture deferred non ancora eseguite scadono dopo almeno un TTL.
+        now = ktime_get_ns();
+        if (the_flow->retained->next != NULL) {
+            next = min(next, the_flow->retained->visible_ns + ttl);
+        } else if (the_flow->total_bytes > 0) {
+            next = min(next, now + ttl);
+        }
+        release_lock(the_flow);
+    }
+
+    if (next != U64_MAX) {
+        now = ktime_get_ns();
+        queue_delayed_work(system_wq, &the_object->reaper, next > now ? nsecs_to_jiffies(next - now) + 1 : 1);
+    }
+}
+
+// --------------------------------------- PRIORITY PREEMPTION --------------------------------------------
+/**
+ * Scarta le scritture deferred del flusso ancora in coda, a partire dalla più recente, finché non sono stati liberati 'needed' bytes.
+ * Una scrittura già presa in carico dalla write_deferred, o destinata al file di spill, non viene scartata. Lo spazio riservato viene
+ * restituito subito, mentre la write_deferred si limita a deallocare i dati ed a completare il numero di sequenza della scrittura.
+ * Va invocata possedendo il lock del flusso. Ritorna i bytes liberati.
+ */
+static unsigned long preempt_deferred(object_state *the_object, flow_state *the_flow, unsigned long needed) {
+    unsigned long freed = 0;
+    packed_work_struct *packed;
+
+    list_for_each_entry_reverse(packed, &the_flow->deferred, node) {
+        if (freed >= needed) {
+            break;
+        }
+        if (packed->spill || atomic_cmpxchg(&packed->state, DEFERRED_QUEUED, DEFERRED_DROPPED) != DEFERRED_QUEUED) {
+            continue;
+        }
+        release_space(the_object, packed->len);
+        the_flow->total_bytes -= packed->len;
+        freed += packed->len;
+    }
+    WRITE_ONCE(the_flow->preempted_bytes, the_flow->preempted_bytes + freed);
+    return freed;
+}
+
+/**
+ * Scarta i blocchi più vecchi del flusso finché non sono stati liberati 'needed' bytes, per tutti i cursori che non li hanno ancora letti:
+ * come per la scadenza dei dati, i lettori distruttivi ed i consumer group saltano i blocchi e lo spazio viene rilasciato dalla trim_flow.
+ * Va invocata possedendo il lock del flusso. Ritorna i bytes di spazio rilasciati.
+ */
+static unsigned long evict_flow(object_state *the_object, flow_state *the_flow, unsigned long needed) {
+    int i;
+    size_t skipped;
+    u64 boundary;
+    u64 released = the_flow->released_pos;
+    unsigned long evicted = 0;
+    stream_block *block;
+    consumer_group *group;
+
+    // Si mantengono i blocchi a partire dal primo che inizia oltre 'needed' bytes dallo spazio già rilasciato
+    for (block = the_flow->retained; block->next != NULL && block->start < released + needed; block = block->next)
+        ;
+    boundary = block->next != NULL ? block->start : the_flow->tail_pos;
+
+    // Lettori distruttivi: si sposta la testa dello stream oltre i blocchi scartati, come in una lettura
+    for (block = the_flow->head; block->next != NULL && block->start < boundary; block = block->next) {
+        evicted += block->size - block->read_offset;
+        block->read_offset = block->size;
+    }
+    the_flow->head = block;
+    the_flow->total_bytes -= evicted;
+    the_flow->ready_bytes -= evicted;
+    the_flow->head_pos += evicted;
+    WRITE_ONCE(the_flow->preempted_bytes, the_flow->preempted_bytes + evicted);
+
+    // Consumer group: i bytes saltati vengono conteggiati tra quelli scartati per il gruppo
+    for (i = 0; i < MAX_GROUPS; i++) {
+        group = &the_flow->groups[i];
+        if (group->members == 0) {
+            continue;
+        }
+        while (group->block->next != NULL && group->block->start < boundary) {
+            skipped = group->block->size - group->offset;
+            group->dropped += skipped;
+            group->block = group->block->next;
+            group->offset = 0;
+            WRITE_ONCE(group->pos, group->pos + skipped);
+        }
+    }
+
+    trim_flow(the_object, the_flow);
+    return the_flow->released_pos - released;
+}
+
+/**
+ * Libera spazio per una scrittura di 'len' bytes sulla classe 'priority' a spese delle classi meno prioritarie, secondo preempt_policy:
+ * prima vengono scartate le scritture deferred ancora in coda, a partire dalla classe meno prioritaria, e con PREEMPT_EVICT poi i dati
+ * non ancora letti più vecchi. I lock delle classi meno prioritarie vengono acquisiti solo se liberi, così che il writer non attenda mai
+ * un lock possedendo già quello del proprio flusso. Ritorna i bytes liberati.
+ */
+static unsigned long preempt_lower(object_state *the_object, int priority, size_t len) {
+    int j;
+    int policy = READ_ONCE(preempt_policy);
+    unsigned long freed = 0;
+    flow_state *the_flow;
+
+    if (policy != PREEMPT_DEFERRED && policy != PREEMPT_EVICT) {
+        return 0;
+    }
+    for (j = 0; j < priority && freed < len; j++) {
+        the_flow = &the_object->priority_flow[j];
+        if (list_empty(&the_flow->deferred) || !mutex_trylock(&the_flow->operation_synchronizer)) {
+            continue;
+        }
+        WRITE_ONCE(the_flow->lock_owner, current);
+        freed += preempt_deferred(the_object, the_flow, len - freed);
+        release_lock(the_flow);
+    }
+    for (j = 0; j < priority && freed < len && policy == PREEMPT_EVICT; j++) {
+        the_flow = &the_object->priority_flow[j];
+        if (!mutex_trylock(&the_flow->operation_synchronizer)) {
+            continue;
+        }
+        WRITE_ONCE(the_flow->lock_owner, current);
+        freed += evict_flow(the_object, the_flow, len - freed);
+        release_lock(the_flow);
+    }
+    if (freed > 0) {
+        printk("%s: %lu bytes of lower priority classes discarded for a %s write\n", MODNAME, freed, get_prio_str(priority));
+    }
+    return freed;
+}
+
+/**
+ * Riserva lo spazio per una scrittura sulla classe 'priority'. Se il dispositivo è pieno si scartano i dati scaduti dei flussi, e poi
+ * secondo preempt_policy i dati delle classi meno prioritarie, riprovando dopo ciascun passo. Il lock del flusso 'held' è già posseduto
+ * dal chiamante (-1 se nessuno). Ritorna 0 se lo spazio è stato riservato, NO_SPACE altrimenti.
+ */
+static int reserve_or_reclaim(object_state *the_object, int priority, int held, size_t len) {
+    if (reserve_space(the_object, len) == 0) {
+        return 0;
+    }
+    if (reclaim_expired(the_object, held) > 0 && reserve_space(the_object, len) == 0) {
+        return 0;
+    }
+    if (preempt_lower(the_object, priority, len) > 0 && reserve_space(the_object, len) == 0) {
+        return 0;
+    }
+    return NO_SPACE;
+}
+
+// ------------------------------------------ WRITE OPERATION ----------------------------------------------
+/**
+ * Implementazione dell'operazione di scrittura del driver. La semantica della scrittura dipende dalla classe di priorità della sessione (parametro flow_mode).
+ *  - Per le classi deferred (di default la bassa priorità) viene invocata la schedule_write che utilizza il meccanismo di deferred work. Il risultato della write viene
+ *    comunque notificato in modo sincrono: per questo si verifica subito se c'è spazio sufficiente per la scrittura e viene subito aggiornato lo spazio rimanente.
+ *
+ *  - Per le classi sincrone (di default l'alta priorità) viene chiamata direttamente la write_on_stream, che effettua la scrittura effettiva sul flusso.
+ *
+ * In caso di errore viene ritornato un errno negativo: -EAGAIN se il lock non è disponibile in un'operazione non bloccante, -ETIMEDOUT se scade il timeout,
+ * -ENOSPC se non c'è spazio sufficiente sul dispositivo, -ENOMEM o -EFAULT se falliscono l'allocazione o la copia dei dati.
+ * Le scritture deferred ritornano -EAGAIN (o attendono, se bloccanti) anche quando la coda delle scritture deferred è piena.
+ *
+ * L'operazione è implementata tramite write_iter, così da essere utilizzabile sia dalla write()/writev() che dalle sottomissioni asincrone di io_uring.
+ *
+ * Nelle classi sincrone sharded (parametro flow_sharded) la scrittura non acquisisce il lock del flusso: i dati vengono accodati nello shard
+ * della CPU corrente tramite write_on_shard, e vengono spostati nello stream dal primo lettore successivo.
+ */
+static ssize_t dev_write(struct kiocb *iocb, struct iov_iter *from) {
+    session_state *session = iocb->ki_filp->private_data;
+    size_t len = iov_iter_count(from);
+    int Minor = session->minor;
+    int priority = session->priority;
+    int blocking = get_blocking(session, iocb);
+    ssize_t written_bytes = 0;
+    int lock;
+    int spill;
+    u64 seq;
+    // Scadenza unica dell'operazione: le attese ripetute (lock, coda deferred) non estendono il timeout complessivo
+    ktime_t deadline = get_deadline(session);
+    // Istante di sottomissione: la latenza submit→visible comprende anche l'attesa del lock e della coda deferred
+    u64 submit_ns = ktime_get_ns();
+
+    object_state *the_object;
+    flow_state *the_flow;
+    the_object = objects[Minor];
+    the_flow = &the_object->priority_flow[priority];
+
+    printk("%s: ------------------------------------- WRITE -------------------------------------------\n", MODNAME);
+    printk(KERN_INFO "%s: Called a %s %s write on dev [%d,%d]\n", MODNAME, get_prio_str(priority), get_block_str(blocking), Major, Minor);
+    printk(KERN_INFO "%s: Write size: %ld bytes | Free space: %ld bytes\n", MODNAME, len, atomic_long_read(&the_object->available_bytes));
+
+    // Limiti di frequenza della sessione e del dispositivo, verificati prima di acquisire il lock e di riservare spazio
+    written_bytes = rate_limit(the_object, session, len, blocking, deadline);
+    if (written_bytes < 0) {
+        printk("%s: Write throttled by rate limits on dev [%d,%d].\n", MODNAME, Major, Minor);
+        return written_bytes;
+    }
+
+    if (the_flow->shards != NULL) {
+        if (reserve_or_reclaim(the_object, priority, -1, len) != 0) {
+            printk("%s: Write error, there is no enough space on dev [%d,%d].\n", MODNAME, Major, Minor);
+            return NO_SPACE;
+        }
+        written_bytes = write_on_shard(from, len, the_object, priority, submit_ns, &seq);
+        if (written_bytes > 0) {
+            session->last_seq = seq;
+            session->last_flow = priority;
+            arm_reaper(the_object, priority);
+        }
+        release_space(the_object, written_bytes < 0 ? len : len - written_bytes);
+        return written_bytes;
+    }
+
+    lock = get_lock(the_object, Minor, priority, blocking, deadline, TRYLOCK);
+
+    if (lock != LOCK_ACQUIRED) {
+        printk("%s: Write error, unable to get lock on dev [%d,%d].\n", MODNAME, Major, Minor);
+        return lock;
+    }
+
+    // Backpressure: se la coda delle scritture deferred è piena, o se un consumer group supererebbe il ritardo massimo con la politica LAG_BLOCK,
+    // un writer non bloccante riceve -EAGAIN mentre un writer bloccante rilascia il lock ed attende che la write_deferred o i lettori smaltiscano i dati.
+    while (write_throttled(the_object, the_flow, priority, len)) {
+        printk("%s: Write throttled on dev [%d,%d].\n", MODNAME, Major, Minor);
+        if (flow_mode[priority] == DEFERRED_WRITE && deferred_queue_full(the_object, len)) {
+            atomic_long_inc(&the_object->deferred_throttled);
+        }
+        release_lock(the_flow);
+        if (blocking == NON_BLOCKING) {
+            return LOCK_NOT_ACQUIRED;
+        }
+
+        lock = wait_for_write_slot(the_object, priority, len, deadline);
+        if (lock < 0) {
+            return lock;
+        }
+        lock = get_lock(the_object, Minor, priority, blocking, deadline, TRYLOCK);
+        if (lock != LOCK_ACQUIRED) {
+            return lock;
+        }
+    }
+
+    // Finché il file di spill contiene dati le nuove scritture vi vengono accodate, così che il file venga scritto e riletto in sequenza.
+    // Con il dispositivo pieno si scartano prima i dati scaduti dei flussi con TTL e, secondo preempt_policy, quelli delle classi meno prioritarie:
+    // solo se lo spazio resta insufficiente si passa al file di spill.
+    spill = (the_flow->spill_bytes > 0 || the_flow->spill_pending > 0) && spill_room(the_flow, priority, len);
+    if (!spill && reserve_or_reclaim(the_object, priority, priority, len) != 0) {
+        spill = spill_room(the_flow, priority, len);
+        if (!spill) {
+            printk("%s: Write error, there is no enough space on dev [%d,%d].\n", MODNAME, Major, Minor);
+            release_lock(the_flow);
+            return NO_SPACE;
+        }
+    }
+
+    // Nelle classi sincrone viene chiamata la write_on_stream, dopo aver ottenuto il lock e controllato che lo spazio sia sufficiente.
+    if (flow_mode[priority] == SYNC_WRITE) {
+        written_bytes = write_on_stream(from, len, the_object, priority, submit_ns, spill);
+    }
+
+    // Nelle classi deferred si chiama la schedule_write, che prepara la memoria, schedula la write e notifica in maniera sincrona il risultato.
+    else {
+        written_bytes = schedule_write(from, len, the_object, Minor, priority, submit_ns, spill);
+    }
+
+    // Si registra il numero di sequenza della scrittura, utilizzato dalle ioctl di flush e da GET_LAST_SEQ.
+    if (written_bytes > 0) {
+        session->last_seq = the_flow->submitted_seq;
+        session->last_flow = priority;
+        arm_reaper(the_object, priority);
+    }
+
+    // Si restituisce lo spazio riservato e non utilizzato, in caso di errore o di copia parziale dei dati. Le scritture nel file di spill non riservano spazio.
+    if (!spill) {
+        release_space(the_object, written_bytes < 0 ? len : len - written_bytes);
+    }
+    release_lock(the_flow);
+    printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
+    return written_bytes;
+}
+
+/**
+ * Esegue la scrittura effettiva sullo stream di una classe di priorità sincrona. Con 'spill' i dati vengono salvati nel file di spill del flusso.
+ */
+ssize_t write_on_stream(struct iov_iter *from, size_t len, object_state *the_object, int priority, u64 submit_ns, int spill) {
+    stream_block *current_block;
+    stream_block *empty_block;
+    ssize_t ret;
+    flow_state *the_flow = &the_object->priority_flow[priority];
+
+    // Allocazione del blocco vuoto per la scrittura successiva
+    empty_block = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+    if (empty_block == NULL) {
+        printk("%s: New block allocation error.\n", MODNAME);
+        return ALLOC_ERROR;
+    }
+
+    // Copia dei bytes da scrivere nel blocco in coda allo stream. Se non viene copiato alcun byte il buffer utente non è valido.
+    current_block = the_flow->tail;
+    ret = fill_block(current_block, from, len);
+    if (ret < 0) {
+        printk("%s: Unable to copy data from user buffer.\n", MODNAME);
+        kmem_cache_free(block_cache, empty_block);
+        return ret;
+    }
+    current_block->enqueue_ns = submit_ns;
+
+    if (spill) {
+        ret = spill_block(the_flow, current_block);
+        if (ret < 0) {
+            printk("%s: Unable to spill the write to the backing file.\n", MODNAME);
+            free_block_data(current_block);
+            kmem_cache_free(block_cache, empty_block);
+            return ret;
+        }
+        ret = current_block->size;
+    }
+
+    // Creazione di un blocco vuoto per la scrittura successiva a quella attuale. Il blocco viene messo in coda allo stream.
+    empty_block->next = NULL;
+    empty_block->stream_content = NULL;
+    empty_block->id = current_block->id + 1;
+
+    current_block->next = empty_block;
+    the_flow->tail = empty_block;
+    publish_block(the_flow, current_block);
+
+    // Aggiornamento del numero di bytes disponibili. Lo spazio sul dispositivo è già stato riservato dalla dev_write.
+    the_flow->ready_bytes += ret;
+    the_flow->total_bytes += ret;
+
+    // La scrittura sincrona è immediatamente visibile nello stream.
+    the_flow->submitted_seq++;
+    current_block->seq = the_flow->submitted_seq;
+    atomic64_set(&the_flow->completed_seq, the_flow->submitted_seq);
+    expire_flow(the_object, the_flow, priority);
+    trim_flow(the_object, the_flow);
+    notify_data(the_object);
+    printk("%s: Written %ld/%ld bytes in block %d (%u pages)\n", MODNAME, current_block->size, len, current_block->id, current_block->nr_pages);
+    return ret;
+}
+
+/**
+ * Accoda la scrittura nello shard della CPU corrente di un flusso sharded, senza acquisire il lock del flusso.
+ * Il numero di sequenza viene assegnato possedendo il lock dello shard, così che i blocchi di ciascuno shard siano sempre ordinati per sequenza.
+ * L'unico dato condiviso tra i writer è il contatore atomico delle sequenze: allocazione e copia dei dati avvengono in parallelo su ogni CPU.
+ */
+ssize_t write_on_shard(struct iov_iter *from, size_t len, object_state *the_object, int priority, u64 submit_ns, u64 *seq) {
+    flow_shard *shard;
+    stream_block *new_block;
+    ssize_t ret;
+    flow_state *the_flow = &the_object->priority_flow[priority];
+
+    // Nessun lock è posseduto, quindi le allocazioni possono attendere
+    new_block = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+    if (new_block == NULL) {
+        printk("%s: New block allocation error.\n", MODNAME);
+        return ALLOC_ERROR;
+    }
+
+    ret = fill_block(new_block, from, len);
+    if (ret < 0) {
+        printk("%s: Unable to copy data from user buffer.\n", MODNAME);
+        kmem_cache_free(block_cache, new_block);
+        return ret;
+    }
+    new_block->next = NULL;
+    // Una scrittura sharded è leggibile appena accodata: i lettori spostano gli shard nello stream prima di leggere.
+    new_block->enqueue_ns = submit_ns;
+    new_block->visible_ns = ktime_get_ns();
+
+    // Se il task migra su un'altra CPU il blocco finisce nello shard precedente: l'ordine è comunque garantito dal numero di sequenza.
+    shard = raw_cpu_ptr(the_flow->shards);
+    spin_lock(&shard->lock);
+    new_block->seq = atomic64_inc_return(&the_flow->shard_seq);
+    if (shard->tail == NULL) {
+        shard->head = new_block;
+    } else {
+        shard->tail->next = new_block;
+    }
+    shard->tail = new_block;
+    shard->bytes += ret;
+    spin_unlock(&shard->lock);
+
+    *seq = new_block->seq;
+
+    // Si risvegliano i lettori solo se ce ne sono in attesa, così da non contendere il lock della waitqueue ad ogni scrittura.
+    if (wq_has_sleeper(&the_object->data_queue)) {
+        notify_data(the_object);
+    }
+    printk("%s: Staged %ld/%ld bytes with sequence %llu on CPU %d\n", MODNAME, ret, len, *seq, raw_smp_processor_id());
+    return ret;
+}
+
+/**
+ * Schedula la scrittura sul flusso a bassa priorità. Copia i dati utente da scrivere in un buffer kernel,
+ * che verrà immesso effettivamente nello stream soltanto quando verrà schedulata la write_deferred.
+ */
+int schedule_write(struct iov_iter *from, size_t len, object_state *the_object, int minor, int priority, u64 submit_ns, int spill) {
+    ssize_t ret;
+    unsigned long depth;
+    packed_work_struct *packed_work;
+    printk("%s: Deferred work requested.\n", MODNAME);
+
+    packed_work = kzalloc(sizeof(packed_work_struct), GFP_KERNEL);
+    if (packed_work == NULL) {
+        printk("%s: Packed work_struct allocation failure\n", MODNAME);
+        return ALLOC_ERROR;
+    }
+
+    packed_work->minor = minor;
+    packed_work->priority = priority;
+    packed_work->spill = spill;
+
+    // Allocazione del blocco che conterrà i dati fino all'esecuzione della write_deferred
+    packed_work->new_block = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+    if (packed_work->new_block == NULL) {
+        printk("%s: Packed work_struct new block allocation failure\n", MODNAME);
+        kfree(packed_work);
+        return ALLOC_ERROR;
+    }
+
+    // Copia dei dati da scrivere nel blocco
+    ret = fill_block(packed_work->new_block, from, len);
+    if (ret < 0) {
+        printk("%s: Unable to copy data from user buffer.\n", MODNAME);
+        kmem_cache_free(block_cache, packed_work->new_block);
+        kfree(packed_work);
+        return ret;
+    }
+    packed_work->len = ret;
+    packed_work->seq = ++the_object->priority_flow[priority].submitted_seq;
+    packed_work->new_block->seq = packed_work->seq;
+    packed_work->new_block->enqueue_ns = submit_ns;
+
+    // Lo spazio libero sul dispositivo è già stato riservato dalla dev_write, mentre quello nel file di spill viene riservato qui
+    // fino all'esecuzione della write_deferred, così che spill_room conti anche le scritture ancora in coda.
+    the_object->priority_flow[priority].total_bytes += ret;
+    if (spill) {
+        WRITE_ONCE(the_object->priority_flow[priority].spill_pending, the_object->priority_flow[priority].spill_pending + ret);
+    }
+
+    // Aggiornamento delle statistiche sulla coda delle scritture deferred
+    depth = atomic_long_inc_return(&the_object->deferred_depth);
+    atomic_long_add(packed_work->len, &the_object->deferred_bytes);
+    if (depth > READ_ONCE(the_object->deferred_peak)) {
+        WRITE_ONCE(the_object->deferred_peak, depth);
+    }
+
+    printk(KERN_INFO "%s: Packed work_struct correctly allocated.\n", MODNAME);
+
+    // Inizializza la work_struct nella struttura packed, specificando come lavoro da eseguire la write_deferred
+    // La work viene accodata alla workqueue ordinata del dispositivo, così da preservare l'ordine FIFO tra scritture deferred successive.
+    __INIT_WORK(&(packed_work->work), &write_deferred, (unsigned long)&(packed_work->work));
+    list_add_tail(&packed_work->node, &the_object->priority_flow[priority].deferred);
+    queue_work(the_object->deferred_wq, &packed_work->work);
+
+    return ret;
+}
+
+/**
+ * Funzione associata alla work_struct in __INIT_WORK, per effettuare la scrittura in modalità deferred.
+ */
+void write_deferred(struct work_struct *deferred_work) {
+    stream_block *current_block;
+    stream_block *empty_block;
+    size_t saved = 0;
+    int dropped;
+
+    packed_work_struct *packed = container_of(deferred_work, packed_work_struct, work);
+    int minor = packed->minor;
+    object_state *the_object = objects[minor];
+    flow_state *the_flow = &the_object->priority_flow[packed->priority];
+    size_t len = packed->len;
+
+    // Una scrittura ancora in coda può essere scartata da una classe più prioritaria, che ne ha già restituito lo spazio. Da qui in poi non più.
+    dropped = atomic_cmpxchg(&packed->state, DEFERRED_QUEUED, DEFERRED_RUNNING) == DEFERRED_DROPPED;
+
+    // La compressione avviene prima di acquisire il lock, fuori dalle sezioni critiche del flusso. Lo spazio risparmiato torna subito disponibile,
+    // tranne che per le scritture destinate al file di spill, che non hanno riservato spazio.
+    if (!dropped) {
+        saved = compress_block(the_object, packed->new_block);
+    }
+    if (!packed->spill) {
+        release_space(the_object, saved);
+    }
+
+    // Ottenimento del lock tramite mutex_lock. Solo a lock acquisito viene eseguita la scrittura.
+    // Il flusso è quello salvato nella packed_work: la sessione che ha richiesto la scrittura potrebbe aver cambiato priorità o essere già stata chiusa.
+    printk("%s: kworker daemon with PID=%d is processing the deferred write operation.\n", MODNAME, current->pid);
+    get_lock(the_object, minor, packed->priority, BLOCKING, 0, LOCK);
+    list_del(&packed->node);
+    if (packed->spill) {
+        WRITE_ONCE(the_flow->spill_pending, the_flow->spill_pending - len);
+    }
+
+    // La scrittura scartata viene soltanto completata, così che i flush che la attendono non restino bloccati
+    if (dropped) {
+        printk("%s: Deferred write %llu was dropped for a higher priority class.\n", MODNAME, packed->seq);
+        free_block_data(packed->new_block);
+        kmem_cache_free(block_cache, packed->new_block);
+        atomic64_set(&the_flow->completed_seq, packed->seq);
+        atomic_long_dec(&the_object->deferred_depth);
+        atomic_long_sub(len, &the_object->deferred_bytes);
+        kfree(packed);
+        release_lock(the_flow);
+        notify_space(the_object);
+        return;
+    }
+
+    // La scrittura è già stata confermata al writer: se il file di spill non è utilizzabile i dati restano in memoria, anche oltre lo spazio libero.
+    if (packed->spill && spill_block(the_flow, packed->new_block) < 0) {
+        printk("%s: Unable to spill the deferred write, keeping it in memory.\n", MODNAME);
+        atomic_long_sub(block_charge(packed->new_block), &the_object->available_bytes);
+    }
+
+    // Si spostano i dati nel blocco in coda al flusso, senza copiarli
+    current_block = the_flow->tail;
+    empty_block = packed->new_block;
+    move_block_data(current_block, empty_block);
+
+    // Il blocco della packed_work diventa il nuovo blocco vuoto
+    empty_block->next = NULL;
+    empty_block->read_offset = 0;
+    empty_block->id = current_block->id + 1;
+
+    // Si aggiunge il blocco vuoto in coda allo stream.
+    current_block->next = empty_block;
+    the_flow->tail = empty_block;
+    publish_block(the_flow, current_block);
+    the_flow->ready_bytes += len;
+    atomic64_set(&the_flow->completed_seq, packed->seq);
+    expire_flow(the_object, the_flow, packed->priority);
+    trim_flow(the_object, the_flow);
+    atomic_long_dec(&the_object->deferred_depth);
+    atomic_long_sub(len, &the_object->deferred_bytes);
+    notify_data(the_object);
+
+    printk("%s: Written %ld/%ld bytes in block %d (%u pages)\n", MODNAME, current_block->size, len, current_block->id, current_block->nr_pages);
+
+    kfree(packed);
+    release_lock(the_flow);
+
+    // La coda delle scritture deferred è condivisa dalle classi deferred del dispositivo: si risvegliano i writer in attesa su tutti i flussi.
+    notify_space(the_object);
+}
+
+// ------------------------------------------ READ OPERATION ----------------------------------------------
+/**
+ * Sposta nello stream le scritture accodate negli shard per-CPU di un flusso sharded. Va invocata possedendo il lock del flusso.
+ * I blocchi di ciascuno shard sono già ordinati per numero di sequenza e vengono fusi nella lista pending del flusso. Dalla lista pending
+ * vengono poi spostati nello stream soltanto i blocchi con numeri di sequenza consecutivi: una scrittura con sequenza minore, accodata in
+ * un altro shard dopo che questo è stato svuotato, viene recuperata dal lettore successivo. Lo stream è quindi sempre ordinato per sequenza.
+ */
+void merge_shards(flow_state *the_flow) {
+    int cpu;
+    size_t block_size;
+    flow_shard *shard;
+    stream_block *staged;
+    stream_block *next_block;
+    stream_block *current_block;
+    stream_block **pos;
+
+    if (the_flow->shards == NULL) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        shard = per_cpu_ptr(the_flow->shards, cpu);
+        if (READ_ONCE(shard->head) == NULL) {
+            continue;
+        }
+
+        // I bytes vengono aggiunti a pending_bytes prima di essere rimossi dallo shard, così che flow_ready_bytes non li perda mai di vista.
+        spin_lock(&shard->lock);
+        staged = shard->head;
+        WRITE_ONCE(the_flow->pending_bytes, the_flow->pending_bytes + shard->bytes);
+        smp_wmb();
+        WRITE_ONCE(shard->bytes, 0);
+        shard->head = NULL;
+        shard->tail = NULL;
+        spin_unlock(&shard->lock);
+
+        // Fusione ordinata dei blocchi dello shard nella lista pending
+        pos = &the_flow->pending;
+        while (staged != NULL) {
+            while (*pos != NULL && (*pos)->seq < staged->seq) {
+                pos = &(*pos)->next;
+            }
+            next_block = staged->next;
+            staged->next = *pos;
+            *pos = staged;
+            pos = &staged->next;
+            staged = next_block;
+        }
+    }
+
+    while (the_flow->pending != NULL && the_flow->pending->seq == the_flow->merged_seq + 1) {
+        staged = the_flow->pending;
+        the_flow->pending = staged->next;
+        block_size = staged->size;
+
+        // Il contenuto viene spostato nel blocco vuoto in coda allo stream, ed il blocco estratto dallo shard diventa il nuovo blocco vuoto.
+        current_block = the_flow->tail;
+        move_block_data(current_block, staged);
+        staged->next = NULL;
+        staged->read_offset = 0;
+        staged->id = current_block->id + 1;
+        current_block->next = staged;
+        the_flow->tail = staged;
+        publish_block(the_flow, current_block);
+
+        the_flow->merged_seq = current_block->seq;
+        the_flow->ready_bytes += block_size;
+        the_flow->total_bytes += block_size;
+        smp_wmb();
+        WRITE_ONCE(the_flow->pending_bytes, the_flow->pending_bytes - block_size);
+    }
+}
+
+/**
+ * Legge al massimo 'len' bytes dal flusso, che deve contenere dati. Va invocata possedendo il lock del flusso.
+ * La lettura avviene in un while(1) leggendo progressivamente i blocchi dello stream. La dimensione di ciascun blocco è quella registrata in scrittura,
+ * quindi i dati possono contenere anche byte nulli.
+ * - Se la dimensione della read va a leggere completamente i bytes di un blocco si passa al blocco successivo. La memoria del blocco viene liberata
+ *   dalla trim_flow, appena il blocco è stato letto anche da tutti i consumer group del flusso.
+ * - Se la lettura non consuma totalmente i bytes di un blocco si aggiorna soltanto l'offset sulla posizione attuale.
+ * Ritorna il numero di bytes letti, oppure -EFAULT se non è stato possibile copiare alcun byte nel buffer utente.
+ */
+ssize_t read_from_flow(object_state *the_object, int priority, int minor, struct iov_iter *to, size_t len) {
+    int ret;
+    int block_residual;
+    long block_size;
+    int to_read;
+    int bytes_read;
+    stream_block *current_block;
+    flow_state *the_flow = &the_object->priority_flow[priority];
+    u64 now = ktime_get_ns();
+
+    current_block = the_flow->head;
+    printk(KERN_INFO "%s: Start reading from head - block%d \n", MODNAME, current_block->id);
+
+    to_read = len;
+    bytes_read = 0;
+
+    // Ciclo in cui vengono letti i bytes richiesti dallo stream.
+    while (1) {
+        block_size = current_block->size;
+        printk(KERN_INFO "%s: Read iteration -> [to_read: %d, block_size: %ld, read_off: %d, bytes_read: %d]\n", MODNAME, to_read, block_size, current_block->read_offset, bytes_read);
+
+        // Richiesta la lettura di più byte rispetto a quelli da leggere nel blocco corrente.
+        if (block_size - current_block->read_offset < to_read) {
+            printk(KERN_INFO "%s: Read | Full reading in block%d", MODNAME, current_block->id);
+            block_residual = block_size - current_block->read_offset;
+            ret = block_residual - block_copy_to_iter(the_object, the_flow, current_block, current_block->read_offset, block_residual, to);
+            bytes_read += (block_residual - ret);
+
+            // Il buffer utente non è interamente scrivibile: il blocco viene mantenuto nello stream con l'offset aggiornato.
+            if (ret != 0) {
+                current_block->read_offset += (block_residual - ret);
+                break;
+            }
+            to_read -= block_residual;
+            if (block_residual > 0) {
+                record_latency(the_flow->read_hist, current_block->visible_ns, now);
+            }
+
+            // Sposto logicamente l'inizio dello stream al blocco successivo.
+            current_block = current_block->next;
+            the_flow->head = current_block;
+            printk(KERN_INFO "%s: Read | Block%d fully read.", MODNAME, current_block->id);
+
+            // Siamo nell'ultimo blocco dello stream e sono stati quindi letti tutti i byte disponibili. Si ritorna al chiamante senza passare al blocco successivo.
+            if (current_block->next == NULL) {
+                printk("%s: Read completed (1), read %d bytes\n", MODNAME, bytes_read);
+                the_flow->tail = current_block;
+                break;
+            }
+        }
+
+        // Il numero di byte richiesti sono presenti nel blocco corrente. Si copiano i byte nel buffer utente e si ritorna al chiamante.
+        else {
+            printk(KERN_INFO "%s: Partial reading in block%d\n", MODNAME, current_block->id);
+            ret = to_read - block_copy_to_iter(the_object, the_flow, current_block, current_block->read_offset, to_read, to);
+            bytes_read += (to_read - ret);
+            current_block->read_offset += (to_read - ret);
+            if (current_block->read_offset == block_size) {
+                record_latency(the_flow->read_hist, current_block->visible_ns, now);
+            }
+            printk("%s: Read completed (2), read %d bytes\n", MODNAME, bytes_read);
+            break;
+        }
+    }
+
+    // Aggiornamento dello spazio disponibile e dei parametri del dispositivo, prima che il chiamante rilasci il lock.
+    the_flow->total_bytes -= bytes_read;
+    the_flow->ready_bytes -= bytes_read;
+    the_flow->head_pos += bytes_read;
+    trim_flow(the_object, the_flow);
+
+    if (bytes_read == 0 && len > 0) {
+        return COPY_ERROR;
+    }
+    return bytes_read;
+}
+
+/**
+ * Legge al massimo 'len' bytes dal cursore del consumer group, senza consumare i dati per gli altri lettori del flusso.
+ * Va invocata possedendo il lock del flusso. Ritorna il numero di bytes letti, oppure -EFAULT se non è stato possibile copiare alcun byte.
+ */
+ssize_t read_from_group(object_state *the_object, flow_state *the_flow, consumer_group *group, struct iov_iter *to, size_t len) {
+    size_t chunk;
+    size_t copied;
+    size_t bytes_read = 0;
+    u64 now = ktime_get_ns();
+
+    while (bytes_read < len && group->block->next != NULL) {
+        chunk = min_t(size_t, group->block->size - group->offset, len - bytes_read);
+        copied = block_copy_to_iter(the_object, the_flow, group->block, group->offset, chunk, to);
+        group->offset += copied;
+        WRITE_ONCE(group->pos, group->pos + copied);
+        bytes_read += copied;
+        if (copied < chunk) {
+            break;
+        }
+        // Blocco letto completamente dal gruppo: il cursore passa al blocco successivo
+        if (group->offset == group->block->size) {
+            record_latency(the_flow->read_hist, group->block->visible_ns, now);
+            group->block = group->block->next;
+            group->offset = 0;
+        }
+    }
+    trim_flow(the_object, the_flow);
+
+    if (bytes_read == 0 && len > 0) {
+        return COPY_ERROR;
+    }
+    return bytes_read;
+}
+
+/**
+ * Lettura di una sessione in un consumer group: si leggono i dati del flusso del gruppo a partire dal cursore condiviso dalle sessioni del gruppo.
+ * Ritorna il numero di bytes letti, NO_DATA se il gruppo ha già letto tutti i dati del flusso, oppure un errno negativo.
+ */
+ssize_t read_group(object_state *the_object, session_state *session, int blocking, ktime_t deadline, struct iov_iter *to, size_t len) {
+    ssize_t ret;
+    flow_state *the_flow = &the_object->priority_flow[session->group_flow];
+    consumer_group *group = &the_flow->groups[session->group];
+
+    ret = get_lock(the_object, session->minor, session->group_flow, blocking, deadline, TRYLOCK);
+    if (ret != LOCK_ACQUIRED) {
+        return ret;
+    }
+    merge_shards(the_flow);
+    expire_flow(the_object, the_flow, session->group_flow);
+    ret = NO_DATA;
+    if (group->pos < the_flow->tail_pos) {
+        stamp_read(session, group->block, group->offset);
+        ret = read_from_group(the_object, the_flow, group, to, len);
+    }
+    release_lock(the_flow);
+    return ret;
+}
+
+/**
+ * Copia al massimo 'len' bytes dello stream a partire dal blocco e dall'offset di un cursore, saltando i primi 'skip' bytes, senza spostare il cursore.
+ * Va invocata possedendo il lock del flusso. Ritorna il numero di bytes copiati.
+ */
+size_t peek_blocks(object_state *the_object, flow_state *the_flow, stream_block *block, size_t offset, u64 skip, struct iov_iter *to, size_t len) {
+    size_t chunk;
+    size_t copied;
+    size_t bytes_read = 0;
+
+    while (bytes_read < len && block->next != NULL) {
+        if (offset + skip >= block->size) {
+            skip -= block->size - offset;
+            block = block->next;
+            offset = 0;
+            continue;
+        }
+        offset += skip;
+        skip = 0;
+        chunk = min_t(size_t, block->size - offset, len - bytes_read);
+        copied = block_copy_to_iter(the_object, the_flow, block, offset, chunk, to);
+        bytes_read += copied;
+        offset += copied;
+        if (copied < chunk) {
+            break;
+        }
+    }
+    return bytes_read;
+}
+
+/**
+ * Lettura non distruttiva: si copiano i dati a partire dal cursore della sessione (quello del consumer group, oppure quello dei lettori
+ * distruttivi del flusso della sessione) spostati di 'skip' bytes, che corrisponde all'offset di una pread(). Il cursore non viene spostato:
+ * i dati vengono consumati solo dalla MFLOW_IOC_COMMIT. Ritorna il numero di bytes copiati, 0 se 'skip' supera i dati in coda,
+ * NO_DATA se non ci sono dati, oppure un errno negativo.
+ */
+ssize_t peek_session(object_state *the_object, session_state *session, int blocking, ktime_t deadline, u64 skip, struct iov_iter *to, size_t len) {
+    ssize_t ret;
+    u64 available;
+    int priority = session->group >= 0 ? session->group_flow : session->priority;
+    flow_state *the_flow = &the_object->priority_flow[priority];
+    consumer_group *group = NULL;
+
+    ret = get_lock(the_object, session->minor, priority, blocking, deadline, TRYLOCK);
+    if (ret != LOCK_ACQUIRED) {
+        return ret;
+    }
+    merge_shards(the_flow);
+    expire_flow(the_object, the_flow, priority);
+    if (session->group >= 0) {
+        group = &the_flow->groups[session->group];
+        available = the_flow->tail_pos - group->pos;
+    } else {
+        available = the_flow->ready_bytes;
+    }
+
+    if (available == 0) {
+        ret = NO_DATA;
+    } else if (skip >= available) {
+        ret = 0;
+    } else {
+        if (group) {
+            stamp_read(session, group->block, group->offset);
+        } else {
+            stamp_read(session, the_flow->head, the_flow->head->read_offset);
+        }
+        ret = group ? peek_blocks(the_object, the_flow, group->block, group->offset, skip, to, len) : peek_blocks(the_object, the_flow, the_flow->head, the_flow->head->read_offset, skip, to, len);
+        if (ret == 0 && len > 0) {
+            ret = COPY_ERROR;
+        }
+    }
+    release_lock(the_flow);
+    return ret;
+}
+
+/**
+ * Consuma al massimo 'len' bytes dal cursore della sessione, senza copiarli: conclude una lettura effettuata in modalità peek.
+ * Ritorna il numero di bytes consumati, minore di 'len' se nel flusso ci sono meno dati.
+ */
+long commit_session(session_state *session, unsigned long len) {
+    int priority = session->group >= 0 ? session->group_flow : session->priority;
+    object_state *the_object = objects[session->minor];
+    flow_state *the_flow = &the_object->priority_flow[priority];
+    consumer_group *group;
+    stream_block *block;
+    size_t committed;
+    size_t step;
+    u64 now = ktime_get_ns();
+
+    get_lock(the_object, session->minor, priority, BLOCKING, 0, LOCK);
+    merge_shards(the_flow);
+    expire_flow(the_object, the_flow, priority);
+    if (session->group >= 0) {
+        group = &the_flow->groups[session->group];
+        committed = min_t(u64, len, the_flow->tail_pos - group->pos);
+        WRITE_ONCE(group->pos, group->pos + committed);
+        for (len = committed; len > 0 || group->offset == group->block->size;) {
+            if (group->offset == group->block->size) {
+                if (group->block->next == NULL) {
+                    break;
+                }
+                group->block = group->block->next;
+                group->offset = 0;
+                continue;
+            }
+            step = min_t(size_t, group->block->size - group->offset, len);
+            group->offset += step;
+            len -= step;
+            if (group->offset == group->block->size) {
+                record_latency(the_flow->read_hist, group->block->visible_ns, now);
+            }
+        }
+    } else {
+        committed = min_t(unsigned long, len, the_flow->ready_bytes);
+        block = the_flow->head;
+        for (len = committed; len > 0 || block->read_offset == block->size;) {
+            if (block->read_offset == block->size) {
+                if (block->next == NULL) {
+                    break;
+                }
+                block = block->next;
+                continue;
+            }
+            step = min_t(size_t, block->size - block->read_offset, len);
+            block->read_offset += step;
+            len -= step;
+            if (block->read_offset == block->size) {
+                record_latency(the_flow->read_hist, block->visible_ns, now);
+            }
+        }
+        the_flow->head = block;
+        the_flow->total_bytes -= committed;
+        the_flow->ready_bytes -= committed;
+        the_flow->head_pos += committed;
+    }
+    trim_flow(the_object, the_flow);
+    release_lock(the_flow);
+
+    if (committed > 0) {
+        session_consumed(session);
+        notify_space(the_object);
+    }
+    printk("%s: thread %d has committed %zu bytes of the %s flow on [%d,%d]\n", MODNAME, current->pid, committed, get_prio_str(priority), Major, session->minor);
+    return committed;
+}
+
+/**
+ * Lettura in modalità READ_ANY: in una sola chiamata si servono le classi di priorità nell'ordine stabilito dallo scheduler della sessione,
+ * passando alla classe successiva se il buffer utente non è stato riempito. Con lo scheduler a priorità stretta si parte sempre dalla classe
+ * più prioritaria, mentre con lo scheduler weighted-fair la prima classe servita dipende dai pesi, così che nessuna classe venga affamata.
+ * Le attese sui lock dei flussi terminano alla scadenza assoluta 'deadline' dell'operazione di lettura.
+ * Ritorna il numero di bytes letti, oppure un errno negativo se non è stato letto alcun byte.
+ */
+ssize_t read_any(object_state *the_object, session_state *session, int blocking, ktime_t deadline, struct iov_iter *to, size_t len) {
+    int i;
+    int priority;
+    int order[MAX_FLOWS];
+    ssize_t ret = NO_DATA;
+    ssize_t bytes_read = 0;
+    flow_state *the_flow;
+
+    build_read_order(the_object, session, order);
+
+    for (i = 0; i < the_object->num_flows && bytes_read < len; i++) {
+        priority = order[i];
+        the_flow = &the_object->priority_flow[priority];
+        if (flow_ready_bytes(the_flow) == 0) {
+            continue;
+        }
+
+        ret = get_lock(the_object, session->minor, priority, blocking, deadline, TRYLOCK);
+        if (ret != LOCK_ACQUIRED) {
+            break;
+        }
+        merge_shards(the_flow);
+        expire_flow(the_object, the_flow, priority);
+        ret = 0;
+        if (the_flow->ready_bytes > 0) {
+            if (bytes_read == 0) {
+                stamp_read(session, the_flow->head, the_flow->head->read_offset);
+            }
+            ret = read_from_flow(the_object, priority, session->minor, to, len - bytes_read);
+        }
+        release_lock(the_flow);
+        if (ret < 0) {
+            break;
+        }
+        bytes_read += ret;
+    }
+
+    if (bytes_read > 0) {
+        return bytes_read;
+    }
+    return ret < 0 ? ret : NO_DATA;
+}
+
+/**
+ * Implementazione dell'operazione di lettura del driver. In modalità READ_SINGLE viene letto solo il flusso selezionato dalla priorità
+ * della sessione, mentre in modalità READ_ANY vengono letti tutti i flussi a partire da quello ad alta priorità.
+ *
+ * Se non ci sono dati da leggere un'operazione non bloccante ritorna -EAGAIN, mentre un'operazione bloccante attende l'arrivo di nuovi dati
+ * fino allo scadere del timeout, ritornando -ETIMEDOUT se non arrivano dati. Il timeout è misurato dall'inizio della lettura:
+ * le attese successive sul lock e sui dati condividono la stessa scadenza assoluta.
+ */
+static ssize_t dev_read(struct kiocb *iocb, struct iov_iter *to) {
+    ssize_t ret;
+    object_state *the_object;
+    flow_state *the_flow;
+    session_state *session = iocb->ki_filp->private_data;
+
+    size_t len = iov_iter_count(to);
+    int Minor = session->minor;
+    int priority = session->priority;
+    int blocking = get_blocking(session, iocb);
+    ktime_t deadline = get_deadline(session);
+
+    the_object = objects[Minor];
+    the_flow = &the_object->priority_flow[priority];
+    printk("%s: -------------------------------------- READ -------------------------------------------\n", MODNAME);
+    printk(KERN_INFO "%s: Called a %s %s read of %ld bytes on dev [%d,%d]\n", MODNAME, get_prio_str(priority), get_block_str(blocking), len, Major, Minor);
+
+    // Le letture vengono limitate nel numero di operazioni al secondo, prima di qualsiasi attesa sul lock o sui dati
+    ret = rate_limit(the_object, session, 0, blocking, deadline);
+    if (ret < 0) {
+        printk("%s: Read throttled by rate limits on dev [%d,%d].\n", MODNAME, Major, Minor);
+        return ret;
+    }
+
+    // Come con SO_RCVLOWAT, una lettura bloccante attende che in coda ci siano almeno rcvlowat bytes (o che scada il max-delay)
+    // prima di consumare i dati. Allo scadere del timeout vengono letti i dati comunque presenti.
+    if (blocking == BLOCKING && deadline != 0 && READ_ONCE(session->relay_active) && !session_data_ready(the_object, session)) {
+        ret = wait_for_data(the_object, session, deadline);
+        if (ret < 0 && ret != LOCK_TIMEOUT) {
+            return ret;
+        }
+    }
+
+    while (1) {
+        if (session->peek) {
+            ret = peek_session(the_object, session, blocking, deadline, iocb->ki_pos, to, len);
+        } else if (session->group >= 0) {
+            ret = read_group(the_object, session, blocking, deadline, to, len);
+        } else if (session->read_mode == READ_ANY) {
+            ret = read_any(the_object, session, blocking, deadline, to, len);
+        } else {
+            // Ottenimento del lock. In base al tipo di operazione blocking/non-blocking si attende o meno.
+            ret = get_lock(the_object, Minor, priority, blocking, deadline, TRYLOCK);
+            if (ret != LOCK_ACQUIRED) {
+                return ret;
+            }
+            merge_shards(the_flow);
+            expire_flow(the_object, the_flow, priority);
+            ret = NO_DATA;
+            if (the_flow->ready_bytes > 0) {
+                stamp_read(session, the_flow->head, the_flow->head->read_offset);
+                ret = read_from_flow(the_object, priority, Minor, to, len);
+            }
+            release_lock(the_flow);
+        }
+
+        if (ret != NO_DATA) {
+            break;
+        }
+
+        // Non sono presenti dati nello stream. Un'operazione non bloccante ritorna subito al chiamante, mentre una bloccante
+        // attende che un writer inserisca nuovi dati in uno dei flussi letti dalla sessione.
+        printk("%s: No data to read on dev [%d,%d]\n", MODNAME, Major, Minor);
+        if (blocking == NON_BLOCKING) {
+            return NO_DATA;
+        }
+        ret = wait_for_data(the_object, session, deadline);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // La memoria liberata è condivisa tra i flussi, quindi si notificano i writer di tutti i flussi.
+    if (ret > 0 && !session->peek) {
+        session_consumed(session);
+        notify_space(the_object);
+    }
+    printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
+    return ret;
+}
+
+/**
+ * Implementazione della poll() del driver, utilizzata da select/poll/epoll per le sessioni non bloccanti.
+ * - POLLIN se nel flusso della sessione (o in uno qualsiasi dei flussi, in modalità READ_ANY) sono presenti dati da leggere.
+ * - POLLOUT se sul dispositivo è presente spazio libero per nuove scritture.
+ * - POLLPRI se tutte le scritture della sessione sono visibili nello stream e il completamento non è ancora stato notificato tramite flush.
+ */
+static __poll_t dev_poll(struct file *filp, poll_table *wait) {
+    session_state *session = filp->private_data;
+    object_state *the_object = objects[session->minor];
+    flow_state *the_flow = &the_object->priority_flow[session->priority];
+    flow_state *last_flow = &the_object->priority_flow[session->last_flow];
+    __poll_t mask = 0;
+
+    // epoll registra le waitqueue una sola volta, all'EPOLL_CTL_ADD, mentre il relay può essere attivato o disattivato in seguito:
+    // si attende quindi sia sulla poll_queue (relay e timer di max-delay) che sulla data_queue, e la soglia viene applicata dal controllo
+    // di session_data_ready sulla maschera.
+    poll_wait(filp, &session->poll_queue, wait);
+    poll_wait(filp, &the_object->data_queue, wait);
+    poll_wait(filp, &the_flow->wait_queue, wait);
+    if (last_flow != the_flow) {
+        poll_wait(filp, &last_flow->wait_queue, wait);
+    }
+
+    if (session->last_seq > session->synced_seq && flow_completed_seq(last_flow) >= session->last_seq) {
+        mask |= EPOLLPRI;
+    }
+
+    if (session_data_ready(the_object, session)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if ((atomic_long_read(&the_object->available_bytes) > 0 || spill_room(the_flow, session->priority, 1)) && !write_throttled(the_object, the_flow, session->priority, 1)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+/**
+ * Abilita o disabilita l'apertura di nuove sessioni sul dispositivo con il minor indicato, come la scrittura del parametro device_enabling.
+ * Le sessioni già aperte non vengono chiuse. Come per il parametro, l'operazione è riservata agli utenti con CAP_SYS_ADMIN.
+ */
+static long set_device_enabling(unsigned long minor, int status) {
+    if (!capable(CAP_SYS_ADMIN)) {
+        return DEV_DISABLED;
+    }
+    if (minor >= NUM_DEVICES) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(device_enabling[minor], status);
+    printk("%s: thread %d has %s the device [%d,%lu]\n", MODNAME, current->pid, status == ENABLED ? "enabled" : "disabled", Major, minor);
+    return 0;
+}
+
+/**
+ * Applica in una sola chiamata i parametri della sessione selezionati dal campo mask. Tutti i valori vengono validati prima di
+ * modificare la sessione, quindi in caso di errore (-EINVAL) la sessione resta invariata.
+ * 'size' è la dimensione codificata nel comando: i client compilati con la versione 1 dell'header passano una struttura senza deadline_ns.
+ */
+static long set_session_params(session_state *session, struct mflow_session_params __user *uparams, size_t size) {
+    struct mflow_session_params params = {0};
+    u32 version = size == MFLOW_SESSION_PARAMS_SIZE_V1 ? 1 : MFLOW_ABI_VERSION;
+    u32 allowed = version == 1 ? MFLOW_PARAM_ALL & ~MFLOW_PARAM_DEADLINE : MFLOW_PARAM_ALL;
+
+    if (copy_from_user(&params, uparams, size)) {
+        return COPY_ERROR;
+    }
+    if (params.version != version || params.mask & ~allowed) {
+        return -EINVAL;
+    }
+    if ((params.mask & MFLOW_PARAM_PRIORITY && params.priority >= objects[session->minor]->num_flows) ||
+        (params.mask & MFLOW_PARAM_BLOCKING && params.blocking != BLOCKING && params.blocking != NON_BLOCKING) ||
+        (params.mask & MFLOW_PARAM_READ_MODE && params.read_mode != READ_SINGLE && params.read_mode != READ_ANY) ||
+        (params.mask & MFLOW_PARAM_READ_MODE && params.scheduler != READ_STRICT && params.scheduler != READ_WEIGHTED) ||
+        (params.mask & MFLOW_PARAM_RCVLOWAT && params.rcvlowat > MAX_SIZE_BYTES) ||
+        (params.mask & MFLOW_PARAM_DEADLINE && params.deadline_ns > KTIME_MAX)) {
+        return -EINVAL;
+    }
+
+    if (params.mask & MFLOW_PARAM_PRIORITY) {
+        session->priority = params.priority;
+    }
+    if (params.mask & MFLOW_PARAM_BLOCKING) {
+        session->blocking = params.blocking;
+    }
+    if (params.mask & MFLOW_PARAM_TIMEOUT) {
+        session->timeout = params.timeout_ns;
+    }
+    if (params.mask & MFLOW_PARAM_DEADLINE) {
+        WRITE_ONCE(session->deadline_ns, params.deadline_ns);
+    }
+    if (params.mask & MFLOW_PARAM_READ_MODE) {
+        session->read_mode = params.read_mode;
+        session->scheduler = params.scheduler;
+        memset(session->sched_credit, 0, sizeof(session->sched_credit));
+    }
+    if (params.mask & (MFLOW_PARAM_RCVLOWAT | MFLOW_PARAM_MAX_DELAY)) {
+        mutex_lock(&session->relay_lock);
+        if (params.mask & MFLOW_PARAM_RCVLOWAT) {
+            session->rcvlowat = params.rcvlowat;
+        }
+        if (params.mask & MFLOW_PARAM_MAX_DELAY) {
+            session->max_delay = params.max_delay_ms;
+        }
+        update_relay(session);
+        mutex_unlock(&session->relay_lock);
+    }
+    printk("%s: thread %d has set the session parameters (mask 0x%x) on [%d,%d]\n", MODNAME, current->pid, params.mask, Major, session->minor);
+    return 0;
+}
+
+/**
+ * Copia nella struttura utente tutti i parametri correnti della sessione, nella versione indicata dalla dimensione del comando.
+ */
+static long get_session_params(session_state *session, struct mflow_session_params __user *uparams, size_t size) {
+    struct mflow_session_params params = {
+        .version = size == MFLOW_SESSION_PARAMS_SIZE_V1 ? 1 : MFLOW_ABI_VERSION,
+        .mask = size == MFLOW_SESSION_PARAMS_SIZE_V1 ? MFLOW_PARAM_ALL & ~MFLOW_PARAM_DEADLINE : MFLOW_PARAM_ALL,
+        .priority = session->priority,
+        .blocking = session->blocking,
+        .timeout_ns = session->timeout,
+        .read_mode = session->read_mode,
+        .scheduler = session->scheduler,
+        .rcvlowat = session->rcvlowat,
+        .max_delay_ms = session->max_delay,
+        .deadline_ns = session->deadline_ns,
+    };
+
+    if (copy_to_user(uparams, &params, size)) {
+        return COPY_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * Imposta i limiti di frequenza della sessione. I crediti dei bucket vengono azzerati, quindi i nuovi limiti partono con un secondo
+ * di crediti disponibili. I contatori della struttura utente vengono ignorati.
+ */
+static long set_rate_limit(session_state *session, struct mflow_rate_limit __user *ulimit) {
+    struct mflow_rate_limit limit;
+
+    if (copy_from_user(&limit, ulimit, sizeof(limit))) {
+        return COPY_ERROR;
+    }
+    spin_lock(&session->rate.lock);
+    session->rate.bytes_tat = 0;
+    session->rate.ops_tat = 0;
+    WRITE_ONCE(session->rate_bytes, limit.bytes_per_sec);
+    WRITE_ONCE(session->rate_ops, limit.ops_per_sec);
+    spin_unlock(&session->rate.lock);
+    printk(
+        "%s: thread %d has set the rate limits to %llu bytes/s and %llu ops/s on [%d,%d]\n",
+        MODNAME, current->pid, limit.bytes_per_sec, limit.ops_per_sec, Major, session->minor);
+    return 0;
+}
+
+/**
+ * Copia nella struttura utente i limiti di frequenza della sessione ed i contatori delle sue operazioni rallentate.
+ */
+static long get_rate_limit(session_state *session, struct mflow_rate_limit __user *ulimit) {
+    struct mflow_rate_limit limit = {
+        .bytes_per_sec = READ_ONCE(session->rate_bytes),
+        .ops_per_sec = READ_ONCE(session->rate_ops),
+        .throttled = atomic_long_read(&session->rate.throttled),
+        .throttled_ns = atomic64_read(&session->rate.throttled_ns),
+    };
+
+    if (copy_to_user(ulimit, &limit, sizeof(limit))) {
+        return COPY_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * Permette di controllare i parametri della sessione di I/O
+ * 3)  Switch to LOW priority (classe 0)
+ * 4)  Switch to HIGH priority (classe più prioritaria del dispositivo)
+ * 5)  Use BLOCKING operations
+ * 6)  Use NON-BLOCKING
+ * 7)  Set timeout in millisecondi
+ * 8)  Enable a device file, con il minor passato come parametro
+ * 9)  Disable a device file, con il minor passato come parametro
+ * 10) Flush delle scritture della sessione
+ * 11) Flush delle scritture del flusso
+ * 12) Numero di sequenza dell'ultima scrittura
+ * 13) Lettura del solo flusso della sessione
+ * 14) Lettura di tutti i flussi, con scheduler a priorità stretta (0) o weighted-fair (1)
+ * 15) Imposta la classe di priorità della sessione
+ * 16) Low-watermark in bytes per il risveglio dei lettori bloccanti e della poll()
+ * 17) Max-delay in millisecondi dei dati in coda sotto il low-watermark
+ * 18) Set timeout in nanosecondi
+ *
+ * Oltre ai codici numerici, mantenuti per compatibilità, sono disponibili i comandi codificati tramite _IOW/_IOR definiti in mflow_ioctl.h:
+ * MFLOW_IOC_SET_SESSION_PARAMS e MFLOW_IOC_GET_SESSION_PARAMS leggono e scrivono tutti i parametri della sessione in una sola chiamata,
+ * mentre MFLOW_IOC_ENABLE_DEV e MFLOW_IOC_DISABLE_DEV abilitano e disabilitano un dispositivo. MFLOW_IOC_JOIN_GROUP e MFLOW_IOC_LEAVE_GROUP
+ * inseriscono e rimuovono la sessione da un consumer group del proprio flusso. MFLOW_IOC_SET_PEEK rende non distruttive le letture della sessione,
+ * e MFLOW_IOC_COMMIT consuma i bytes già esaminati. MFLOW_IOC_GET_READ_TIMES restituisce gli istanti di sottomissione e di visibilità
+ * del primo messaggio dell'ultima lettura. MFLOW_IOC_SET_RATE_LIMIT e MFLOW_IOC_GET_RATE_LIMIT impostano e leggono i limiti di frequenza
+ * della sessione, insieme ai contatori delle operazioni rallentate. I comandi da 10 a 18 hanno un equivalente MFLOW_IOC_* con lo stesso
+ * significato e la stessa codifica del parametro, tranne MFLOW_IOC_GET_LAST_SEQ e MFLOW_IOC_SET_TIMEOUT_NS che ricevono un puntatore
+ * a __u64: i codici numerici restano solo come alias per i client esistenti. I comandi non riconosciuti ritornano -ENOTTY.
+ *
+ * Le operazioni di flush sono sempre bloccanti, come una fsync(), ed attendono al massimo fino alla scadenza della sessione (timeout o
+ * deadline_ns). Come per letture e scritture, senza timeout né scadenza non si attende: se le scritture non sono ancora visibili il flush
+ * ritorna subito -ETIMEDOUT. Per attendere il completamento in modo asincrono si può utilizzare l'evento POLLPRI.
+ */
+long set_session_param(session_state *session, unsigned int command, unsigned long param) {
+    int Minor = session->minor;
+    long ret = 0;
+    u64 seq, timeout_ns;
+    u32 minor;
+    struct mflow_read_times times;
+    flow_state *the_flow;
+
+    switch (command) {
+        case SET_LOW_PRIORITY:
+            session->priority = 0;
+            printk(
+                "%s: ioctl(%u) | thread %d has set priority level to LOW on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            break;
+        case SET_HIGH_PRIORITY:
+            session->priority = objects[Minor]->num_flows - 1;
+            printk(
+                "%s: ioctl(%u) | thread %d has set priority level to HIGH on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            break;
+        case SET_BLOCKING_OP:
+            session->blocking = BLOCKING;
+            printk(
+                "%s: ioctl(%u) | thread %d has set operation type to BLOCKING on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            break;
+        case SET_NON_BLOCKING_OP:
+            session->blocking = NON_BLOCKING;
+            printk(
+                "%s: ioctl(%u) | thread %d has set operation type to NON-BLOCKING on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            break;
+        case SET_TIMEOUT:
+            session->timeout = (u64)param * NSEC_PER_MSEC;
+            printk(
+                "%s: ioctl(%u) | thread %d has changed the TIMEOUT value to %llu ns on [%d,%d]\n",
+                MODNAME, command, current->pid, session->timeout, Major, Minor);
+            break;
+        case ENABLE_DEV:
+            ret = set_device_enabling(param, ENABLED);
+            break;
+        case DISABLE_DEV:
+            ret = set_device_enabling(param, DISABLED);
+            break;
+        case MFLOW_IOC_ENABLE_DEV:
+        case MFLOW_IOC_DISABLE_DEV:
+            ret = get_user(minor, (__u32 __user *)param);
+            if (ret == 0) {
+                ret = set_device_enabling(minor, command == MFLOW_IOC_ENABLE_DEV ? ENABLED : DISABLED);
+            }
+            break;
+        case MFLOW_IOC_JOIN_GROUP:
+            ret = join_group(session, (const char __user *)param);
+            break;
+        case MFLOW_IOC_LEAVE_GROUP:
+            ret = leave_group(session, 1);
+            break;
+        case MFLOW_IOC_SET_PEEK:
+            session->peek = param ? 1 : 0;
+            printk(
+                "%s: ioctl(%u) | thread %d has %s peek mode on [%d,%d]\n",
+                MODNAME, command, current->pid, session->peek ? "enabled" : "disabled", Major, Minor);
+            break;
+        case MFLOW_IOC_COMMIT:
+            ret = commit_session(session, param);
+            break;
+        case MFLOW_IOC_GET_READ_TIMES:
+            times.enqueue_ns = session->read_enqueue_ns;
+            times.visible_ns = session->read_visible_ns;
+            if (copy_to_user((struct mflow_read_times __user *)param, &times, sizeof(times))) {
+                ret = COPY_ERROR;
+            }
+            break;
+        case MFLOW_IOC_SET_RATE_LIMIT:
+            ret = set_rate_limit(session, (struct mflow_rate_limit __user *)param);
+            break;
+        case MFLOW_IOC_GET_RATE_LIMIT:
+            ret = get_rate_limit(session, (struct mflow_rate_limit __user *)param);
+            break;
+        case MFLOW_IOC_SET_SESSION_PARAMS:
+        case MFLOW_IOC_SET_SESSION_PARAMS_V1:
+            ret = set_session_params(session, (struct mflow_session_params __user *)param, _IOC_SIZE(command));
+            break;
+        case MFLOW_IOC_GET_SESSION_PARAMS:
+        case MFLOW_IOC_GET_SESSION_PARAMS_V1:
+            ret = get_session_params(session, (struct mflow_session_params __user *)param, _IOC_SIZE(command));
+            break;
+        case SET_TIMEOUT_NS:
+        case MFLOW_IOC_SET_TIMEOUT_NS:
+            timeout_ns = param;
+            if (command == MFLOW_IOC_SET_TIMEOUT_NS && get_user(timeout_ns, (u64 __user *)param)) {
+                ret = COPY_ERROR;
+                break;
+            }
+            session->timeout = timeout_ns;
+            printk(
+                "%s: ioctl(%u) | thread %d has changed the TIMEOUT value to %llu ns on [%d,%d]\n",
+                MODNAME, command, current->pid, session->timeout, Major, Minor);
+            break;
+        case FLUSH_SESSION:
+        case MFLOW_IOC_FLUSH_SESSION:
+            seq = session->last_seq;
+            ret = wait_for_seq(&objects[Minor]->priority_flow[session->last_flow], seq, get_deadline(session));
+            if (ret == 0 && seq > session->synced_seq) {
+                session->synced_seq = seq;
+            }
+            printk(
+                "%s: ioctl(%u) | thread %d has flushed its writes up to %llu on [%d,%d]\n",
+                MODNAME, command, current->pid, seq, Major, Minor);
+            break;
+        case FLUSH_FLOW:
+        case MFLOW_IOC_FLUSH_FLOW:
+            the_flow = &objects[Minor]->priority_flow[session->priority];
+            seq = flow_submitted_seq(the_flow);
+            ret = wait_for_seq(the_flow, seq, get_deadline(session));
+            if (ret == 0 && session->last_flow == session->priority && session->last_seq <= seq) {
+                session->synced_seq = session->last_seq;
+            }
+            printk(
+                "%s: ioctl(%u) | thread %d has flushed the %s flow up to %llu on [%d,%d]\n",
+                MODNAME, command, current->pid, get_prio_str(session->priority), seq, Major, Minor);
+            break;
+        case GET_LAST_SEQ:
+        case MFLOW_IOC_GET_LAST_SEQ:
+            ret = put_user(session->last_seq, (u64 __user *)param);
+            break;
+        case SET_READ_SINGLE:
+        case MFLOW_IOC_SET_READ_SINGLE:
+            session->read_mode = READ_SINGLE;
+            printk(
+                "%s: ioctl(%u) | thread %d has set read mode to SINGLE on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            break;
+        case SET_READ_ANY:
+        case MFLOW_IOC_SET_READ_ANY:
+            if (param != READ_STRICT && param != READ_WEIGHTED) {
+                ret = -EINVAL;
+                break;
+            }
+            session->read_mode = READ_ANY;
+            session->scheduler = param;
+            memset(session->sched_credit, 0, sizeof(session->sched_credit));
+            printk(
+                "%s: ioctl(%u) | thread %d has set read mode to ANY (scheduler %d) on [%d,%d]\n",
+                MODNAME, command, current->pid, session->scheduler, Major, Minor);
+            break;
+        case SET_PRIORITY:
+        case MFLOW_IOC_SET_PRIORITY:
+            if (param >= objects[Minor]->num_flows) {
+                ret = -EINVAL;
+                break;
+            }
+            session->priority = param;
+            printk(
+                "%s: ioctl(%u) | thread %d has set priority class to %lu on [%d,%d]\n",
+                MODNAME, command, current->pid, param, Major, Minor);
+            break;
+        case SET_RCVLOWAT:
+        case MFLOW_IOC_SET_RCVLOWAT:
+            if (param > MAX_SIZE_BYTES) {
+                ret = -EINVAL;
+                break;
+            }
+            mutex_lock(&session->relay_lock);
+            session->rcvlowat = param;
+            update_relay(session);
+            mutex_unlock(&session->relay_lock);
+            printk(
+                "%s: ioctl(%u) | thread %d has set the receive low-watermark to %lu bytes on [%d,%d]\n",
+                MODNAME, command, current->pid, param, Major, Minor);
+            break;
+        case SET_MAX_DELAY:
+        case MFLOW_IOC_SET_MAX_DELAY:
+            mutex_lock(&session->relay_lock);
+            session->max_delay = param;
+            update_relay(session);
+            mutex_unlock(&session->relay_lock);
+            printk(
+                "%s: ioctl(%u) | thread %d has set the max delay to %lu ms on [%d,%d]\n",
+                MODNAME, command, current->pid, param, Major, Minor);
+            break;
+        default:
+            printk(
+                "%s: ioctl(%u) | thread %d has used an illegal command on [%d,%d]\n",
+                MODNAME, command, current->pid, Major, Minor);
+            ret = BAD_COMMAND;
+    }
+    return ret;
+}
+
+/**
+ * Implementazione della ioctl() del driver, modifica i parametri della sessione associata al file.
+ */
+static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
+    return set_session_param(filp->private_data, command, param);
+}
+
+#ifdef HAVE_URING_CMD
+/**
+ * Passthrough io_uring (IORING_OP_URING_CMD): permette di modificare priorità, tipo di operazione e timeout della sessione
+ * tramite una SQE, nello stesso batch delle letture e scritture asincrone. Il cmd_op della SQE corrisponde al codice della ioctl,
+ * mentre il parametro è letto dai primi 8 bytes del payload del comando.
+ * Sono accettati solo i comandi che modificano un campo della sessione senza mai sospendere il chiamante: la uring_cmd può essere
+ * eseguita inline nel contesto di sottomissione (IO_URING_F_NONBLOCK), quindi flush, consumer group, commit e gli altri comandi
+ * che possono bloccarsi ritornano -EOPNOTSUPP e vanno richiesti tramite ioctl().
+ */
+static int dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    const u64 *param = get_uring_payload(ioucmd);
+
+    switch (ioucmd->cmd_op) {
+        case SET_LOW_PRIORITY:
+        case SET_HIGH_PRIORITY:
+        case SET_BLOCKING_OP:
+        case SET_NON_BLOCKING_OP:
+        case SET_TIMEOUT:
+        case SET_TIMEOUT_NS:
+        case SET_PRIORITY:
+        case MFLOW_IOC_SET_PRIORITY:
+            return set_session_param(ioucmd->file->private_data, ioucmd->cmd_op, READ_ONCE(*param));
+        case MFLOW_IOC_SET_TIMEOUT_NS:
+            // Il payload della SQE contiene direttamente il timeout, non un puntatore utente
+            return set_session_param(ioucmd->file->private_data, SET_TIMEOUT_NS, READ_ONCE(*param));
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+#endif
+
+/*
+ * Definizione delle file_operations del Driver.
+ */
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .write_iter = dev_write,
+    .read_iter = dev_read,
+    .open = dev_open,
+    .release = dev_release,
+    .poll = dev_poll,
+#ifdef HAVE_URING_CMD
+    .uring_cmd = dev_uring_cmd,
+#endif
+    .unlocked_ioctl = dev_ioctl};
+
+// ---------------------------------------------- CHECKPOINT ----------------------------------------------
+/**
+ * Scrive 'len' bytes nel file di checkpoint alla posizione 'pos', che viene fatta avanzare. Ritorna 0 oppure CHECKPOINT_ERROR.
  */
-static int dev_release(struct inode *inode, struct file *file) {
-    printk("%s: ------------------------------------- CLOSE -------------------------------------------\n", MODNAME);
-
-    kfree(file->private_data);
-    printk(KERN_INFO "%s: Session state %d correctly deallocated.\n", MODNAME, current->pid);
-    printk("%s: Device file %d closed by process %d\n", MODNAME, Minor, current->pid);
-    return 0;
+static int checkpoint_write(struct file *file, const void *buf, size_t len, loff_t *pos) {
+    return kernel_write(file, buf, len, pos) == (ssize_t)len ? 0 : CHECKPOINT_ERROR;
 }
 
-// ------------------------------------------ WRITE OPERATION ----------------------------------------------
 /**
- * Implementazione dell'operazione di scrittura del driver.
- *  - Per le operazioni a bassa priorità viene invocata la write_low che utilizza il meccanismo di deferred work. Il risultato della write viene
- *    comunque notificato in modo sincrono: per questo si verifica subito se c'è spazio sufficiente per la scrittura e viene subito aggiornato lo spazio rimanente.
- *
- *  - Per le operazioni ad alta priorità viene chiamata direttamente la write_on_stream, che internamente cerca di prendere il lock ed effettua la scrittura effettiva sul flusso.
+ * Legge 'len' bytes dal file di checkpoint alla posizione 'pos', che viene fatta avanzare. Ritorna 0 oppure CHECKPOINT_ERROR.
  */
-static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t *off) {
-    session_state *session = filp->private_data;
-    int priority = session->priority;
-    int blocking = session->blocking;
-    ssize_t written_bytes = 0;
-    int lock;
-
-    object_state *the_object;
-    flow_state *the_flow;
-    the_object = &objects[Minor];
-    the_flow = &the_object->priority_flow[priority];
-
-    printk("%s: ------------------------------------- WRITE -------------------------------------------\n", MODNAME);
-    printk(KERN_INFO "%s: Called a %s %s write on dev [%d,%d]\n", MODNAME, get_prio_str(priority), get_block_str(blocking), Major, Minor);
-    printk(KERN_INFO "%s: Write size: %ld bytes | Free space: %ld bytes\n", MODNAME, len, the_object->available_bytes);
+static int checkpoint_read(struct file *file, void *buf, size_t len, loff_t *pos) {
+    return kernel_read(file, buf, len, pos) == (ssize_t)len ? 0 : CHECKPOINT_ERROR;
+}
 
-    lock = get_lock(the_object, session, Minor, TRYLOCK);
+/**
+ * Salva nel checkpoint i dati non ancora letti di un blocco, a partire da 'offset'. Un blocco nel file di spill viene prima riletto.
+ * I dati compressi vengono salvati così come sono, tranne che per un blocco già letto in parte, che viene decompresso.
+ */
+static int export_block(struct file *file, loff_t *pos, object_state *the_object, flow_state *the_flow, stream_block *block, size_t offset) {
+    int ret;
+    size_t chunk;
+    checkpoint_block record;
 
-    if (lock == LOCK_NOT_ACQUIRED) {
-        printk("%s: Write error, unable to get lock on dev [%d,%d].\n", MODNAME, Major, Minor);
-        return WRITE_ERROR;
+    if (block->spilled && load_spilled(the_object, the_flow, block) < 0) {
+        return CHECKPOINT_ERROR;
     }
-
-    if (len > the_object->available_bytes) {
-        printk("%s: Write error, there is no enough space on dev [%d,%d].\n", MODNAME, Major, Minor);
-        release_lock(the_flow);
-        return WRITE_ERROR;
+    if (offset > 0 && inflate_block(the_object, block) < 0) {
+        return CHECKPOINT_ERROR;
     }
 
-    // Ad alta priorità viene chiamata la write_on_stream, dopo aver ottenuto il lock e controllato che lo spazio sia sufficiente.
-    if (priority == HIGH_PRIORITY) {
-        written_bytes = write_on_stream(buff, len, the_object);
+    record.seq = block->seq;
+    record.enqueue_ns = block->enqueue_ns;
+    record.visible_ns = block->visible_ns;
+    record.size = block->size - offset;
+    record.stored_size = block->stored_size;
+    ret = checkpoint_write(file, &record, sizeof(record), pos);
+    if (ret < 0) {
+        return ret;
     }
 
-    // Nel flusso a bassa priorità si chiama la schedule_write, che prepara la memoria, schedula la write e notifica in maniera sincrona il risultato.
-    else if (priority == LOW_PRIORITY) {
-        written_bytes = schedule_write(buff, len, session, the_object);
+    if (block->stored_size > 0) {
+        return checkpoint_write(file, block->stream_content, block->stored_size, pos);
     }
-
-    release_lock(the_flow);
-    printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
-    return written_bytes;
+    if (block->pages == NULL) {
+        return checkpoint_write(file, block->stream_content + offset, block->size - offset, pos);
+    }
+    while (offset < block->size) {
+        chunk = min_t(size_t, PAGE_SIZE - offset_in_page(offset), block->size - offset);
+        ret = checkpoint_write(file, page_address(block->pages[offset >> PAGE_SHIFT]) + offset_in_page(offset), chunk, pos);
+        if (ret < 0) {
+            return ret;
+        }
+        offset += chunk;
+    }
+    return 0;
 }
 
 /**
- * Esegue la scrittura effettiva sullo stream ad alta priorità.
+ * Salva nel checkpoint le statistiche di un flusso ed i blocchi non ancora letti dai lettori distruttivi. I cursori dei consumer group
+ * non vengono salvati: allo smontaggio del modulo non esistono sessioni, e quindi nemmeno membri dei gruppi.
  */
-ssize_t write_on_stream(const char *buff, size_t len, object_state *the_object) {
-    stream_block *current_block;
-    stream_block *empty_block;
-    char *block_buff;
-    int ret;
-    flow_state *the_flow = &the_object->priority_flow[HIGH_PRIORITY];
-
-    // Allocazione delle strutture necessarie alla scrittura
-    block_buff = kzalloc(len + 1, GFP_ATOMIC);
-    if (block_buff == NULL) {
-        printk("%s: Data buffer allocation error.\n", MODNAME);
-        return WRITE_ERROR;
+static int export_flow(struct file *file, loff_t *pos, object_state *the_object, flow_state *the_flow) {
+    int i, ret;
+    size_t offset;
+    stream_block *block;
+    checkpoint_flow record;
+
+    merge_shards(the_flow);
+
+    memset(&record, 0, sizeof(record));
+    for (block = the_flow->head; block != the_flow->tail; block = block->next) {
+        offset = block == the_flow->head ? the_flow->head->read_offset : 0;
+        if (block->size > offset) record.blocks++;
     }
-    empty_block = kzalloc(sizeof(stream_block), GFP_ATOMIC);
-    if (empty_block == NULL) {
-        printk("%s: New block allocation error.\n", MODNAME);
-        return SCHED_ERROR;
+    record.seq = flow_submitted_seq(the_flow);
+    record.expired_bytes = the_flow->expired_bytes;
+    record.spin_acquired = atomic_long_read(&the_flow->spin_acquired);
+    record.spin_failed = atomic_long_read(&the_flow->spin_failed);
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        record.visible_hist[i] = the_flow->visible_hist[i];
+        record.read_hist[i] = the_flow->read_hist[i];
     }
+    ret = checkpoint_write(file, &record, sizeof(record), pos);
 
-    // Copia dei bytes da scrivere nel stream_block del dispositivo.
-    ret = copy_from_user(block_buff, buff, len);
-    current_block = the_flow->tail;
-    current_block->stream_content = block_buff;
-
-    // Creazione di un blocco vuoto per la scrittura successiva a quella attuale. Il blocco viene messo in coda allo stream.
-    empty_block->next = NULL;
-    empty_block->stream_content = NULL;
-    empty_block->id = current_block->id + 1;
-
-    current_block->next = empty_block;
-    the_flow->tail = empty_block;
-
-    // Aggiornamento del numero di bytes disponibili
-    the_object->available_bytes -= (len - ret);
-    total_bytes_high[Minor] += (len - ret);
-    printk("%s: Written %ld/%ld bytes in block %d: '%s'\n", MODNAME, strlen(current_block->stream_content), len, current_block->id, current_block->stream_content);
-    return len - ret;
+    for (block = the_flow->head; ret == 0 && block != the_flow->tail; block = block->next) {
+        offset = block == the_flow->head ? the_flow->head->read_offset : 0;
+        if (block->size > offset) {
+            ret = export_block(file, pos, the_object, the_flow, block, offset);
+        }
+    }
+    return ret;
 }
 
 /**
- * Schedula la scrittura sul flusso a bassa priorità. Copia i dati utente da scrivere in un buffer kernel,
- * che verrà immesso effettivamente nello stream soltanto quando verrà schedulata la write_deferred.
+ * Salva nel file checkpoint_path i dati in coda in tutti i dispositivi allocati, insieme alle loro statistiche. Viene invocata dalla
+ * cleanup_module dopo la deregistrazione del driver: non esistono sessioni aperte, quindi i flussi vengono letti senza lock dopo aver
+ * atteso il completamento delle scritture deferred e fermato la scadenza dei dati. L'header viene riscritto per ultimo con il numero
+ * di dispositivi salvati, così che un checkpoint interrotto non venga mai ricaricato.
  */
-int schedule_write(const char *buff, size_t len, session_state *session, object_state *the_object) {
-    int ret;
-    packed_work_struct *packed_work;
-    printk("%s: Deferred work requested.\n", MODNAME);
+static void export_checkpoint(void) {
+    int i, j, ret = 0;
+    loff_t pos = 0;
+    struct file *file;
+    object_state *the_object;
+    checkpoint_header header = {.magic = CHECKPOINT_MAGIC, .version = CHECKPOINT_VERSION, .lat_buckets = LAT_BUCKETS, .devices = 0};
+    checkpoint_device record;
 
-    packed_work = kzalloc(sizeof(packed_work_struct), GFP_ATOMIC);
-    if (packed_work == NULL) {
-        printk("%s: Packed work_struct allocation failure\n", MODNAME);
-        return SCHED_ERROR;
+    if (checkpoint_path == NULL || checkpoint_path[0] == '\0') {
+        return;
+    }
+    file = filp_open(checkpoint_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk("%s: Unable to open checkpoint file %s (%ld)\n", MODNAME, checkpoint_path, PTR_ERR(file));
+        return;
     }
 
-    packed_work->len = len;
-    packed_work->session = session;
-    packed_work->minor = Minor;
+    ret = checkpoint_write(file, &header, sizeof(header), &pos);
+    for (i = 0; i < NUM_DEVICES && ret == 0; i++) {
+        the_object = objects[i];
+        if (the_object == NULL) {
+            continue;
+        }
+        flush_workqueue(the_object->deferred_wq);
+        cancel_delayed_work_sync(&the_object->reaper);
+
+        record.minor = i;
+        record.num_flows = the_object->num_flows;
+        record.deferred_peak = the_object->deferred_peak;
+        record.deferred_throttled = atomic_long_read(&the_object->deferred_throttled);
+        record.compress_in = the_object->compress_in;
+        record.compress_out = the_object->compress_out;
+        ret = checkpoint_write(file, &record, sizeof(record), &pos);
+        for (j = 0; j < the_object->num_flows && ret == 0; j++) {
+            ret = export_flow(file, &pos, the_object, &the_object->priority_flow[j]);
+        }
+        header.devices++;
+    }
 
-    // Allocazione delle strutture per effettuare la scrittura successivamente
-    packed_work->data = kzalloc(len + 1, GFP_ATOMIC);
-    if (packed_work->data == NULL) {
-        printk("%s: Packed work_struct data allocation failure\n", MODNAME);
-        return SCHED_ERROR;
+    if (ret == 0) {
+        pos = 0;
+        ret = checkpoint_write(file, &header, sizeof(header), &pos);
     }
-    packed_work->new_block = kzalloc(sizeof(stream_block), GFP_ATOMIC);
-    if (packed_work->new_block == NULL) {
-        printk("%s: Packed work_struct new block allocation failure\n", MODNAME);
-        return SCHED_ERROR;
+    if (ret < 0) {
+        printk("%s: Error writing checkpoint file %s, it will not be restored\n", MODNAME, checkpoint_path);
+    } else {
+        printk("%s: Queued data of %u devices saved in checkpoint file %s\n", MODNAME, header.devices, checkpoint_path);
     }
-
-    // Copia dei dati da scrivere nel buffer
-    ret = copy_from_user((char *)packed_work->data, buff, len);
-
-    // Riservo logicamente lo spazio libero sul dispositivo
-    the_object->available_bytes -= (len - ret);
-    total_bytes_low[Minor] += (len - ret);
-
-    printk(KERN_INFO "%s: Packed work_struct correctly allocated.\n", MODNAME);
-
-    // Inizializza la work_struct nella struttura packed, specificando come lavoro da eseguire la write_deferred
-    __INIT_WORK(&(packed_work->work), &write_deferred, (unsigned long)&(packed_work->work));
-    schedule_work(&packed_work->work);
-
-    return len - ret;
+    filp_close(file, NULL);
 }
 
 /**
- * Funzione associata alla work_struct in __INIT_WORK, per effettuare la scrittura in modalità deferred.
+ * Ricarica dal checkpoint un blocco del flusso, accodandolo allo stream come una scrittura sincrona. Con 'the_flow' a NULL, oppure se lo spazio
+ * del dispositivo non è sufficiente, i dati del blocco vengono letti e scartati. Allo stesso modo vengono scartati i blocchi compressi se il modulo
+ * è stato compilato senza LZ4. Un record non valido interrompe il caricamento: il resto del file non può più essere interpretato.
+ * Ritorna 0 oppure un codice di errore.
  */
-void write_deferred(struct work_struct *deferred_work) {
+static int import_block(struct file *file, loff_t *pos, object_state *the_object, flow_state *the_flow) {
+    int ret;
+    size_t len;
+    char *content;
     stream_block *current_block;
     stream_block *empty_block;
+    checkpoint_block record;
 
-    packed_work_struct *packed = container_of(deferred_work, packed_work_struct, work);
-    int minor = packed->minor;
-    session_state *session = packed->session;
-    object_state *the_object = &objects[minor];
-    flow_state *the_flow = &the_object->priority_flow[LOW_PRIORITY];
-    size_t len = packed->len;
+    ret = checkpoint_read(file, &record, sizeof(record), pos);
+    if (ret < 0) {
+        return ret;
+    }
+    // Un blocco deve rientrare nello spazio di un dispositivo, ed un blocco compresso occupa meno bytes dei dati originali
+    if (record.size > MAX_SIZE_BYTES || (record.stored_size > 0 && record.stored_size >= record.size)) {
+        printk("%s: Invalid block record (%u/%u bytes) in checkpoint file %s\n", MODNAME, record.stored_size, record.size, checkpoint_path);
+        return CHECKPOINT_ERROR;
+    }
+    len = record.stored_size > 0 ? record.stored_size : record.size;
+#ifndef HAVE_LZ4
+    if (record.stored_size > 0 && the_flow != NULL) {
+        printk("%s: LZ4 not available, discarding a compressed block of %u bytes\n", MODNAME, record.size);
+        *pos += len;
+        return 0;
+    }
+#endif
+    if (the_flow == NULL || reserve_space(the_object, len) < 0) {
+        if (the_flow != NULL) {
+            printk("%s: No space left to restore a block of %u bytes, discarding it\n", MODNAME, record.size);
+        }
+        *pos += len;
+        return 0;
+    }
 
-    // Ottenimento del lock tramite mutex_lock. Solo a lock acquisito viene eseguita la scrittura.
-    printk("%s: kworker daemon with PID=%d is processing the deferred write operation.\n", MODNAME, current->pid);
-    get_lock(the_object, session, minor, LOCK);
+    content = kvmalloc(len + 1, GFP_KERNEL);
+    empty_block = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+    if (content == NULL || empty_block == NULL) {
+        ret = ALLOC_ERROR;
+        goto revert;
+    }
+    ret = checkpoint_read(file, content, len, pos);
+    if (ret < 0) {
+        goto revert;
+    }
+    content[len] = '\0';
+#ifdef HAVE_LZ4
+    if (record.stored_size > 0) {
+        ret = compressed_valid(content, record.stored_size, record.size);
+        if (ret < 0) {
+            printk("%s: Corrupted compressed block in checkpoint file %s\n", MODNAME, checkpoint_path);
+            goto revert;
+        }
+    }
+#endif
 
-    // Si scrivono i dati sul flusso
+    // I dati vengono spostati nel blocco in coda allo stream, a cui segue un nuovo blocco vuoto
     current_block = the_flow->tail;
-    current_block->stream_content = (char *)packed->data;
-
-    // Si inizializza il blocco vuoto
-    empty_block = packed->new_block;
-    empty_block->next = NULL;
-    empty_block->stream_content = NULL;
+    current_block->stream_content = content;
+    current_block->size = record.size;
+    current_block->stored_size = record.stored_size;
+    current_block->seq = record.seq;
+    current_block->enqueue_ns = record.enqueue_ns;
+    current_block->visible_ns = record.visible_ns;
     empty_block->id = current_block->id + 1;
-
-    // Si aggiunge il blocco vuoto in coda allo stream.
     current_block->next = empty_block;
     the_flow->tail = empty_block;
+    publish_block(the_flow, current_block);
+    the_flow->ready_bytes += record.size;
+    the_flow->total_bytes += record.size;
+    return 0;
 
-    printk("%s: Written %ld/%ld bytes in block %d: '%s'\n", MODNAME, strlen(current_block->stream_content), len, current_block->id, current_block->stream_content);
-
-    kfree(packed);
-    release_lock(the_flow);
+revert:
+    kvfree(content);
+    if (empty_block != NULL) {
+        kmem_cache_free(block_cache, empty_block);
+    }
+    release_space(the_object, len);
+    return ret;
 }
 
-// ------------------------------------------ READ OPERATION ----------------------------------------------
 /**
- * Implementazione dell'operazione di lettura del driver. Questa avviene in un while(1) leggendo progressivamente i blocchi dello stream.
- * - Se la dimensione della read va a leggere completamente i bytes di un blocco si libera la rispettiva area di memoria e si passa al blocco successivo.
- * - Se la lettura non consuma totalmente i bytes di un blocco si aggiorna soltanto l'offset sulla posizione attuale.
+ * Ricarica dal checkpoint le statistiche ed i blocchi di un flusso. Con 'the_flow' a NULL (classe non più presente sul dispositivo) il flusso
+ * viene letto e scartato. Gli istogrammi vengono ripristinati dopo i blocchi, perché la publish_block vi registra la loro latenza.
  */
-static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off) {
-    int ret;
-    int cls;
-    int block_residual;
-    long block_size;
-    int to_read;
-    int bytes_read;
-    int old_id;
-    object_state *the_object;
-    flow_state *the_flow;
-    stream_block *current_block;
-    stream_block *completed_block;
-    session_state *session = filp->private_data;
-
-    int priority = session->priority;
-    int blocking = session->blocking;
-
-    cls = clear_user(buff, len);
-
-    the_object = &objects[Minor];
-    the_flow = &the_object->priority_flow[priority];
-    printk("%s: -------------------------------------- READ -------------------------------------------\n", MODNAME);
-    printk(KERN_INFO "%s: Called a %s %s read of %ld bytes on dev [%d,%d]\n", MODNAME, get_prio_str(priority), get_block_str(blocking), len, Major, Minor);
-
-    // Ottenimento del lock. In base al tipo di operazione blocking/non-blocking si attende o meno.
-    ret = get_lock(the_object, session, Minor, TRYLOCK);
-    if (ret < 0) {
-        return READ_ERROR;
+static int import_flow(struct file *file, loff_t *pos, object_state *the_object, flow_state *the_flow) {
+    int i, ret;
+    u64 j;
+    checkpoint_flow record;
+
+    ret = checkpoint_read(file, &record, sizeof(record), pos);
+    for (j = 0; j < record.blocks && ret == 0; j++) {
+        ret = import_block(file, pos, the_object, the_flow);
     }
-
-    current_block = the_flow->head;
-    printk(KERN_INFO "%s: Start reading from head - block%d \n", MODNAME, current_block->id);
-
-    // Non sono presenti dati nello stream, quindi viene rilasciato il lock e si ritorna al chiamante.
-    if (current_block->stream_content == NULL) {
-        printk("%s: No data to read in current block\n", MODNAME);
-        release_lock(the_flow);
-        return READ_ERROR;
+    if (ret < 0 || the_flow == NULL) {
+        return ret;
     }
 
-    to_read = len;
-    bytes_read = 0;
-
-    // Ciclo in cui vengono letti i bytes richiesti dallo stream.
-    while (1) {
-        block_size = strlen(current_block->stream_content);
-        printk(KERN_INFO "%s: Read iteration -> [to_read: %d, block_size: %ld, read_off: %d, bytes_read: %d]\n", MODNAME, to_read, block_size, current_block->read_offset, bytes_read);
-
-        // Richiesta la lettura di più byte rispetto a quelli da leggere nel blocco corrente.
-        if (block_size - current_block->read_offset < to_read) {
-            printk(KERN_INFO "%s: Read | Full reading in block%d", MODNAME, current_block->id);
-            block_residual = block_size - current_block->read_offset;
-            to_read -= block_residual;
-            ret = copy_to_user(&buff[bytes_read], &(current_block->stream_content[current_block->read_offset]), block_residual);
-            bytes_read += (block_residual - ret);
+    the_flow->submitted_seq = record.seq;
+    the_flow->merged_seq = record.seq;
+    atomic64_set(&the_flow->completed_seq, record.seq);
+    atomic64_set(&the_flow->shard_seq, record.seq);
+    the_flow->expired_bytes = record.expired_bytes;
+    atomic_long_set(&the_flow->spin_acquired, record.spin_acquired);
+    atomic_long_set(&the_flow->spin_failed, record.spin_failed);
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        the_flow->visible_hist[i] = record.visible_hist[i];
+        the_flow->read_hist[i] = record.read_hist[i];
+    }
+    return 0;
+}
 
-            // Sposto logicamente l'inizio dello stream al blocco successivo.
-            old_id = current_block->id;
-            completed_block = current_block;
-            current_block = current_block->next;
-            the_flow->head = current_block;
+/**
+ * Ricarica dal file checkpoint_path i dati salvati dallo smontaggio precedente del modulo. Viene invocata dalla init_module prima della
+ * registrazione del driver, quindi i flussi vengono scritti senza lock. I dispositivi salvati vengono allocati, e le classi di priorità
+ * non più configurate vengono scartate.
+ * Ritorna 1 se il checkpoint è stato letto completamente e senza errori, 0 se non c'è un checkpoint oppure se la lettura è fallita:
+ * in questo caso il file non va troncato, così che i dati non vadano persi.
+ */
+static int import_checkpoint(void) {
+    int j, ret;
+    u32 i;
+    loff_t pos = 0;
+    struct file *file;
+    object_state *the_object;
+    checkpoint_header header;
+    checkpoint_device record;
 
-            // Sono stati letti tutti i dati dal blocco precedente, quindi posso liberare la rispettiva area di memoria.
-            kfree(completed_block->stream_content);
-            kfree(completed_block);
-            printk(KERN_INFO "%s: Read | Block%d fully read. Memory released.", MODNAME, current_block->id);
-
-            // Siamo nell'ultimo blocco dello stream e sono stati quindi letti tutti i byte disponibili. Si sblocca il mutex e si ritorna al chiamante senza passare al blocco successivo.
-            if (current_block->stream_content == NULL) {
-                if (priority == HIGH_PRIORITY) {
-                    total_bytes_high[Minor] -= bytes_read;
-                } else {
-                    total_bytes_low[Minor] -= bytes_read;
-                }
-                printk("%s: Read completed (1), read %d bytes\n", MODNAME, bytes_read);
-                the_flow->head = current_block;
-                the_flow->tail = current_block;
-                the_object->available_bytes += bytes_read;
-                release_lock(the_flow);
-                printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
+    if (checkpoint_path == NULL || checkpoint_path[0] == '\0') {
+        return 0;
+    }
+    file = filp_open(checkpoint_path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file)) {
+        return 0;
+    }
 
-                return bytes_read;
-            }
+    ret = checkpoint_read(file, &header, sizeof(header), &pos);
+    if (ret < 0 || header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION || header.lat_buckets != LAT_BUCKETS) {
+        // Un file vuoto è un checkpoint già ricaricato, oppure non completato
+        if (i_size_read(file_inode(file)) > 0) {
+            printk("%s: Checkpoint file %s is not valid, ignoring it\n", MODNAME, checkpoint_path);
         }
+        filp_close(file, NULL);
+        return 0;
+    }
 
-        // Il numero di byte richiesti sono presenti nel blocco corrente. Si copiano i byte nel buffer utente, si sblocca il mutex e si ritorna al chiamante.
-        else {
-            printk(KERN_INFO "%s: Partial reading in block%d\n", MODNAME, current_block->id);
-            ret = copy_to_user(&buff[bytes_read], &(current_block->stream_content[current_block->read_offset]), to_read);
-            bytes_read += (to_read - ret);
-            current_block->read_offset += (to_read - ret);
-            if (priority == HIGH_PRIORITY) {
-                total_bytes_high[Minor] -= bytes_read;
-            } else {
-                total_bytes_low[Minor] -= bytes_read;
-            }
-            printk("%s: Read completed (2), read %d bytes\n", MODNAME, bytes_read);
-            release_lock(the_flow);
-            the_object->available_bytes += bytes_read;
-            printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
-            return bytes_read;
+    for (i = 0; i < header.devices && ret == 0; i++) {
+        ret = checkpoint_read(file, &record, sizeof(record), &pos);
+        if (ret < 0 || record.minor >= NUM_DEVICES || record.num_flows > MAX_FLOWS) {
+            ret = CHECKPOINT_ERROR;
+            break;
+        }
+        the_object = get_object(record.minor);
+        if (the_object == NULL) {
+            ret = ALLOC_ERROR;
+            break;
+        }
+        for (j = 0; j < (int)record.num_flows && ret == 0; j++) {
+            ret = import_flow(file, &pos, the_object, j < the_object->num_flows ? &the_object->priority_flow[j] : NULL);
+        }
+        the_object->deferred_peak = record.deferred_peak;
+        atomic_long_set(&the_object->deferred_throttled, record.deferred_throttled);
+        the_object->compress_in = record.compress_in;
+        the_object->compress_out = record.compress_out;
+        for (j = 0; j < the_object->num_flows; j++) {
+            arm_reaper(the_object, j);
         }
     }
+    filp_close(file, NULL);
+
+    if (ret < 0) {
+        printk("%s: Error reading checkpoint file %s, restored data may be incomplete\n", MODNAME, checkpoint_path);
+        return 0;
+    }
+    printk("%s: Queued data of %u devices restored from checkpoint file %s\n", MODNAME, header.devices, checkpoint_path);
+    return 1;
 }
 
 /**
- * Permette di controllare i parametri della sessione di I/O
- * 3)  Switch to HIGH priority
- * 4)  Switch to LOW priority
- * 5)  Use BLOCKING operations
- * 6)  Use NON-BLOCKING
- * 7)  Set timeout
- * 8)  Enable a device file  [UNUSED]
- * 9)  Disable a device file [UNUSED]
+ * Tronca il file di checkpoint già ricaricato, così che gli stessi dati non vengano ricaricati due volte. Viene invocata solo al termine
+ * di una init_module completata con successo: se il caricamento del modulo fallisce il checkpoint resta disponibile per il tentativo successivo.
  */
-static long dev_ioctl(struct file *filp, unsigned int command, unsigned long param) {
-    session_state *session;
-    session = filp->private_data;
-
-    switch (command) {
-        case SET_LOW_PRIORITY:
-            session->priority = LOW_PRIORITY;
-            printk(
-                "%s: ioctl(%u) | thread %d has set priority level to LOW on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
-            break;
-        case SET_HIGH_PRIORITY:
-            session->priority = HIGH_PRIORITY;
-            printk(
-                "%s: ioctl(%u) | thread %d has set priority level to HIGH on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
-            break;
-        case SET_BLOCKING_OP:
-            session->blocking = BLOCKING;
-            printk(
-                "%s: ioctl(%u) | thread %d has set operation type to BLOCKING on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
-            break;
-        case SET_NON_BLOCKING_OP:
-            session->blocking = NON_BLOCKING;
-            printk(
-                "%s: ioctl(%u) | thread %d has set operation type to NON-BLOCKING on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
-            break;
-        case SET_TIMEOUT:
-            session->timeout = param;
-            printk(
-                "%s: ioctl(%u) | thread %d has changed the TIMEOUT value on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
-            break;
-        default:
-            printk(
-                "%s: ioctl(%u) | thread %d has used an illegal command on [%d,%d]\n",
-                MODNAME, command, current->pid, Major, Minor);
+static void truncate_checkpoint(void) {
+    struct file *file = filp_open(checkpoint_path, O_WRONLY | O_TRUNC | O_LARGEFILE, 0);
+    if (!IS_ERR(file)) {
+        filp_close(file, NULL);
     }
-    return 0;
 }
 
-/*
- * Definizione delle file_operations del Driver.
+/**
+ * Rilascia le risorse di tutti i dispositivi e la cache dei blocchi. Viene usata sia dalla cleanup_module che per annullare
+ * un'inizializzazione fallita nella init_module.
  */
-static struct file_operations fops = {
-    .owner = THIS_MODULE,
-    .write = dev_write,
-    .read = dev_read,
-    .open = dev_open,
-    .release = dev_release,
-    .unlocked_ioctl = dev_ioctl};
+static void release_objects(void) {
+    int i;
+
+    for (i = 0; i < NUM_DEVICES; i++) {
+        release_object(objects[i]);
+        objects[i] = NULL;
+    }
+
+    // Tutti i blocchi sono stati restituiti alla cache, che può essere distrutta in blocco.
+    if (block_cache != NULL) {
+        kmem_cache_destroy(block_cache);
+        block_cache = NULL;
+    }
+}
 
 /*
- *  Inizializza tutti i dispositivi e registra il Char Device nel kernel. Fornisce inoltre tramite printk il Major Number che viene assegnato al Driver.
+ *  Inizializza il driver e registra il Char Device nel kernel. Fornisce inoltre tramite printk il Major Number che viene assegnato al Driver.
+ *  Lo stato di ciascun dispositivo viene allocato alla prima apertura, dalla get_object.
  */
 int init_module(void) {
-    int i, j;
+    int i, restored;
     printk("%s: -------------------------------------- INIT -------------------------------------------\n", MODNAME);
 
-    // Inizializzazione dei dispositivi
-    printk(KERN_INFO "%s: Initializing Object State.\n", MODNAME);
-    for (i = 0; i < NUM_DEVICES; i++) {
-        for (j = 0; j < NUM_FLOWS; j++) {
-            flow_state *object_flow = &objects[i].priority_flow[j];
-            mutex_init(&(object_flow->operation_synchronizer));
-
-            // Allocazione per il primo blocco dello stream
-            object_flow->head = kzalloc(sizeof(stream_block), GFP_KERNEL);
-            object_flow->head->id = 0;
-            object_flow->tail = object_flow->head;
-            object_flow->head->next = NULL;
-            object_flow->head->stream_content = NULL;
-            object_flow->head->read_offset = 0;
-
-            // Inizializzazione della waitqueue
-            init_waitqueue_head(&object_flow->wait_queue);
+    // Cache dedicata ai blocchi dello stream
+    block_cache = kmem_cache_create("mflow_stream_block", sizeof(stream_block), 0, 0, NULL);
+    if (block_cache == NULL) {
+        printk("%s: Error creating stream block cache\n", MODNAME);
+        return ALLOC_ERROR;
+    }
 
-            if (object_flow->head == NULL) goto revert_allocation;
-        }
+    // Configurazione dei dispositivi
+    for (i = 0; i < NUM_DEVICES; i++) {
+        // Numero di classi di priorità del dispositivo: valori non validi vengono riportati al default.
+        if (device_flows[i] < 1 || device_flows[i] > MAX_FLOWS) device_flows[i] = DEFAULT_FLOWS;
 
         // Di default tutti i dispositivi sono abilitati
         device_enabling[i] = ENABLED;
-        objects[i].available_bytes = MAX_SIZE_BYTES;
     }
-    printk(KERN_INFO "%s: Object State correctly Initialized.\n", MODNAME);
+
+    // Ripristino dei dati salvati allo smontaggio precedente, prima che il driver sia accessibile
+    restored = import_checkpoint();
 
     // Registrazione del Char Device Driver
-    Major = __register_chrdev(0, 0, 128, DEVICE_NAME, &fops);
+    Major = __register_chrdev(0, 0, NUM_DEVICES, DEVICE_NAME, &fops);
     if (Major < 0) {
         printk("%s: registering device failed\n", MODNAME);
+        release_objects();
         return Major;
     }
     printk("%s: New device registered, it is assigned major number %d\n", MODNAME, Major);
-    printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
 
-    return 0;
+    // Creazione dei nodi /dev/mflow-devN. Un nodo non creato può comunque essere aggiunto manualmente tramite mknod.
+    mflow_class = mflow_class_create(DEVICE_NAME);
+    if (IS_ERR(mflow_class)) {
+        printk("%s: creating device class failed\n", MODNAME);
+        __unregister_chrdev(Major, 0, NUM_DEVICES, DEVICE_NAME);
+        release_objects();
+        return PTR_ERR(mflow_class);
+    }
+    for (i = 0; i < NUM_DEVICES; i++) {
+        if (IS_ERR(device_create(mflow_class, NULL, MKDEV(Major, i), NULL, DEVICE_NAME "%d", i))) {
+            printk("%s: creating device node %s%d failed\n", MODNAME, DEVICE_NAME, i);
+        }
+    }
 
-revert_allocation:
-    printk(KERN_INFO "Error allocating stream head block. Revert allocation\n");
-    for (; i >= 0; i--) {
-        kfree(&objects[i].priority_flow[j].head);
+    // Statistiche per classe di priorità. Un errore di debugfs non compromette il funzionamento del driver.
+    debugfs_dir = debugfs_create_dir("multiflow_driver", NULL);
+    debugfs_create_file("flows", 0440, debugfs_dir, NULL, &flows_fops);
+    debugfs_create_file("groups", 0440, debugfs_dir, NULL, &groups_fops);
+    debugfs_create_file("latency", 0440, debugfs_dir, NULL, &latency_fops);
+
+    // Il checkpoint viene svuotato solo ora che il modulo è stato caricato, e solo se è stato ricaricato completamente
+    if (restored) {
+        truncate_checkpoint();
     }
-    return -ENOMEM;
+    printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
+
+    return 0;
 }
 
 /**
  * Effettua il cleanup del modulo quando questo viene smontato/deregistrato
  */
 void cleanup_module(void) {
-    int i = 0;
-    int j = 0;
+    int i;
     printk("%s: ------------------------------------- CLEAN -------------------------------------------\n", MODNAME);
     printk(KERN_INFO "%s: Unregistering the device, releasing pending resources.\n", MODNAME);
 
-    // Rilascio delle risorse
+    // Deregistrazione del Device, prima di rilasciare le risorse così che non possano essere aperte nuove sessioni.
     for (i = 0; i < NUM_DEVICES; i++) {
-        for (j = 0; j < NUM_FLOWS; j++) {
-            flow_state *object_flow = &objects[i].priority_flow[j];
-            stream_block *current_block = object_flow->head;
-
-            // Deallocazione di tutti i blocchi dati dello stream.
-            while (current_block->stream_content != NULL) {
-                kfree(current_block->stream_content);
-                current_block = current_block->next;
-            }
-        }
+        device_destroy(mflow_class, MKDEV(Major, i));
     }
-    printk(KERN_INFO "%s: Data stream memory released.\n", MODNAME);
-
-    // Deregistrazione del Device.
-    unregister_chrdev(Major, DEVICE_NAME);
+    class_destroy(mflow_class);
+    __unregister_chrdev(Major, 0, NUM_DEVICES, DEVICE_NAME);
     printk("%s: The device with major number %d has been unregistered.\n", MODNAME, Major);
+    debugfs_remove_recursive(debugfs_dir);
+
+    // Salvataggio dei dati ancora in coda, e rilascio delle risorse attendendo il completamento delle scritture deferred ancora in coda.
+    export_checkpoint();
+    release_objects();
+    printk(KERN_INFO "%s: Data stream memory released.\n", MODNAME);
     printk("%s: ---------------------------------------------------------------------------------------\n", MODNAME);
     return;
 }
\ No newline at end of file
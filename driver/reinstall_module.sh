@@ -1,6 +1,7 @@
-sudo rm /dev/mflow-dev*
+CHECKPOINT=/var/tmp/multiflow_driver.ckpt
+echo "$CHECKPOINT" | sudo tee /sys/module/multiflow_driver/parameters/checkpoint_path > /dev/null 2>&1
 sudo rmmod multiflow_driver.ko
 make clean
 make all
-sudo insmod multiflow_driver.ko
+sudo insmod multiflow_driver.ko checkpoint_path=$CHECKPOINT
 make clean
\ No newline at end of file
@@ -0,0 +1,92 @@
+/*
+=====================================================================================================
+                                          mflow_ioctl.h
+-----------------------------------------------------------------------------------------------------
+ABI delle ioctl del driver, condivisa tra il modulo kernel ed i client utente.
+I comandi sono codificati tramite _IOW/_IOR, e le strutture contengono un numero di versione
+così che client compilati con versioni diverse dell'header vengano riconosciuti dal driver.
+=====================================================================================================
+*/
+
+#ifndef MFLOW_IOCTL_H
+#define MFLOW_IOCTL_H
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MFLOW_IOC_MAGIC 'M'
+#define MFLOW_ABI_VERSION 2  // Versione corrente di struct mflow_session_params
+
+// Campi di struct mflow_session_params da applicare con MFLOW_IOC_SET_SESSION_PARAMS
+#define MFLOW_PARAM_PRIORITY (1 << 0)   // Classe di priorità della sessione
+#define MFLOW_PARAM_BLOCKING (1 << 1)   // Operazioni bloccanti o non bloccanti
+#define MFLOW_PARAM_TIMEOUT (1 << 2)    // Timeout delle operazioni bloccanti
+#define MFLOW_PARAM_READ_MODE (1 << 3)  // Modalità di lettura e scheduler
+#define MFLOW_PARAM_RCVLOWAT (1 << 4)   // Low-watermark dei lettori
+#define MFLOW_PARAM_MAX_DELAY (1 << 5)  // Max-delay dei dati sotto il low-watermark
+#define MFLOW_PARAM_DEADLINE (1 << 6)   // Scadenza assoluta delle operazioni bloccanti, dalla versione 2
+#define MFLOW_PARAM_ALL 0x7f
+
+#define MFLOW_GROUP_NAME_LEN 16  // Lunghezza massima del nome di un consumer group, compreso il terminatore
+
+/**
+ * Parametri di una sessione, letti e scritti in una sola chiamata
+ */
+struct mflow_session_params {
+    __u32 version;       // Versione dell'ABI, deve valere MFLOW_ABI_VERSION
+    __u32 mask;          // Campi da applicare (MFLOW_PARAM_*). Con GET_SESSION_PARAMS il driver li imposta tutti
+    __u32 priority;      // Classe di priorità [0,num_flows-1]
+    __u32 blocking;      // [0,1] = [blocking,non-blocking]
+    __u64 timeout_ns;    // Timeout delle operazioni bloccanti in nanosecondi [0 = nessuna attesa]
+    __u32 read_mode;     // [0,1] = [solo il flusso della sessione, tutti i flussi]
+    __u32 scheduler;     // Scheduler delle letture su tutti i flussi [0,1] = [priorità stretta, weighted-fair]
+    __u64 rcvlowat;      // Low-watermark in bytes dei lettori bloccanti e della poll()
+    __u64 max_delay_ms;  // Millisecondi massimi di attesa dei dati sotto il low-watermark [0 = nessun limite]
+    __u64 deadline_ns;   // Scadenza assoluta (CLOCK_MONOTONIC) delle operazioni bloccanti, combinata con il timeout [0 = nessuna scadenza]
+};
+
+// Dimensione della versione 1 di struct mflow_session_params, senza deadline_ns, ancora accettata dal driver
+#define MFLOW_SESSION_PARAMS_SIZE_V1 48
+
+/**
+ * Istanti, in nanosecondi di CLOCK_MONOTONIC, del primo messaggio restituito dall'ultima lettura della sessione
+ */
+struct mflow_read_times {
+    __u64 enqueue_ns;  // Sottomissione della scrittura, all'ingresso della write()
+    __u64 visible_ns;  // Inserimento nello stream: per le classi deferred è l'esecuzione della write_deferred
+};
+
+/**
+ * Limiti di frequenza della sessione, applicati con un token bucket che accumula al massimo un secondo di crediti.
+ * I contatori sono restituiti da MFLOW_IOC_GET_RATE_LIMIT ed ignorati da MFLOW_IOC_SET_RATE_LIMIT.
+ */
+struct mflow_rate_limit {
+    __u64 bytes_per_sec;  // Bytes scritti al secondo [0 = nessun limite]
+    __u64 ops_per_sec;    // Letture e scritture al secondo [0 = nessun limite]
+    __u64 throttled;      // Operazioni della sessione rallentate o rifiutate dai limiti della sessione o del dispositivo
+    __u64 throttled_ns;   // Tempo complessivo trascorso in attesa dalle operazioni rallentate
+};
+
+#define MFLOW_IOC_SET_SESSION_PARAMS _IOW(MFLOW_IOC_MAGIC, 1, struct mflow_session_params)
+#define MFLOW_IOC_GET_SESSION_PARAMS _IOR(MFLOW_IOC_MAGIC, 2, struct mflow_session_params)
+#define MFLOW_IOC_SET_SESSION_PARAMS_V1 _IOC(_IOC_WRITE, MFLOW_IOC_MAGIC, 1, MFLOW_SESSION_PARAMS_SIZE_V1)  // Client compilati con la versione 1
+#define MFLOW_IOC_GET_SESSION_PARAMS_V1 _IOC(_IOC_READ, MFLOW_IOC_MAGIC, 2, MFLOW_SESSION_PARAMS_SIZE_V1)   // Client compilati con la versione 1
+#define MFLOW_IOC_ENABLE_DEV _IOW(MFLOW_IOC_MAGIC, 3, __u32)   // Abilita il dispositivo con il minor passato come parametro
+#define MFLOW_IOC_DISABLE_DEV _IOW(MFLOW_IOC_MAGIC, 4, __u32)  // Disabilita il dispositivo con il minor passato come parametro
+#define MFLOW_IOC_JOIN_GROUP _IOW(MFLOW_IOC_MAGIC, 5, char[MFLOW_GROUP_NAME_LEN])  // Entra nel consumer group indicato del flusso della sessione
+#define MFLOW_IOC_LEAVE_GROUP _IO(MFLOW_IOC_MAGIC, 6)                             // Esce dal consumer group, tornando a consumare il flusso in modo distruttivo
+#define MFLOW_IOC_SET_PEEK _IO(MFLOW_IOC_MAGIC, 7)                                // Con parametro 1 le letture non consumano i dati, con 0 torna alle letture normali
+#define MFLOW_IOC_COMMIT _IO(MFLOW_IOC_MAGIC, 8)                                  // Consuma i primi N bytes del flusso della sessione, ritorna i bytes consumati
+#define MFLOW_IOC_GET_READ_TIMES _IOR(MFLOW_IOC_MAGIC, 9, struct mflow_read_times)  // Istanti di sottomissione e visibilità del primo messaggio dell'ultima lettura
+#define MFLOW_IOC_SET_RATE_LIMIT _IOW(MFLOW_IOC_MAGIC, 10, struct mflow_rate_limit)  // Imposta i limiti di frequenza della sessione, azzerandone i crediti
+#define MFLOW_IOC_GET_RATE_LIMIT _IOR(MFLOW_IOC_MAGIC, 11, struct mflow_rate_limit)  // Limiti di frequenza e contatori delle attese della sessione
+#define MFLOW_IOC_FLUSH_SESSION _IO(MFLOW_IOC_MAGIC, 12)          // Attende che tutte le scritture della sessione siano visibili nello stream
+#define MFLOW_IOC_FLUSH_FLOW _IO(MFLOW_IOC_MAGIC, 13)             // Attende che tutte le scritture già sottomesse al flusso della sessione siano visibili
+#define MFLOW_IOC_GET_LAST_SEQ _IOR(MFLOW_IOC_MAGIC, 14, __u64)   // Numero di sequenza dell'ultima scrittura della sessione
+#define MFLOW_IOC_SET_READ_SINGLE _IO(MFLOW_IOC_MAGIC, 15)        // Le letture consumano solo il flusso selezionato dalla priorità della sessione
+#define MFLOW_IOC_SET_READ_ANY _IO(MFLOW_IOC_MAGIC, 16)           // Le letture consumano tutti i flussi, con lo scheduler passato come parametro
+#define MFLOW_IOC_SET_PRIORITY _IO(MFLOW_IOC_MAGIC, 17)           // Imposta la classe di priorità passata come parametro
+#define MFLOW_IOC_SET_RCVLOWAT _IO(MFLOW_IOC_MAGIC, 18)           // Bytes minimi in coda per risvegliare i lettori bloccanti e la poll()
+#define MFLOW_IOC_SET_MAX_DELAY _IO(MFLOW_IOC_MAGIC, 19)          // Millisecondi massimi di attesa dei dati sotto il low-watermark
+#define MFLOW_IOC_SET_TIMEOUT_NS _IOW(MFLOW_IOC_MAGIC, 20, __u64)  // Timeout delle operazioni bloccanti in nanosecondi
+
+#endif
\ No newline at end of file
@@ -8,33 +8,107 @@ Mantiene tutti i parametri e le costanti utilizzate all'interno del device drive
 
 #ifndef PARAMS_H
 #define PARAMS_H
+#include <linux/debugfs.h>
+#include <linux/device.h> /* For class_create/device_create */
+#include <linux/falloc.h> /* For FALLOC_FL_PUNCH_HOLE */
 #include <linux/fs.h>
+#include <linux/hrtimer.h> /* For the max-delay timer */
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/math64.h> /* For mul_u64_u64_div_u64 */
+#include <linux/mm.h> /* For kvcalloc/kvfree */
 #include <linux/module.h>
+#include <linux/numa.h>
+#include <linux/percpu.h>
 #include <linux/pid.h> /* For pid types */
+#include <linux/poll.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h> /* For shmem_file_setup */
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
 #include <linux/tty.h>     /* For the tty declarations */
+#include <linux/uio.h>     /* For struct iov_iter */
 #include <linux/version.h> /* For LINUX_VERSION_CODE */
 #include <linux/workqueue.h>
 
+#include "mflow_ioctl.h"
+
+// Il passthrough io_uring (file_operations->uring_cmd) è disponibile dal kernel 5.19
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define HAVE_URING_CMD
+#if __has_include(<linux/io_uring/cmd.h>)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// La compressione delle scritture deferred richiede la libreria LZ4 del kernel, sia in compressione che in decompressione
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define HAVE_LZ4
+#include <linux/lz4.h>
+#endif
+
+// class_create non riceve più il modulo proprietario dal kernel 6.4
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define mflow_class_create(name) class_create(name)
+#else
+#define mflow_class_create(name) class_create(THIS_MODULE, name)
+#endif
+
+// timer_delete e timer_delete_sync sostituiscono del_timer e del_timer_sync dal kernel 6.2
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_delete del_timer
+#define timer_delete_sync del_timer_sync
+#endif
+
 #define MODNAME "MULTI-FLOW DEV"
 #define DEVICE_NAME "mflow-dev"
 
 #define MAX_SIZE_BYTES 1048576  // Massima dimensione di byte mantenibili da un singolo device (1MB)
 
 #define NUM_DEVICES 128
-#define NUM_FLOWS 2
+#define MAX_FLOWS 8      // Numero massimo di classi di priorità gestibili da un singolo device
+#define MAX_GROUPS 8     // Numero massimo di consumer group per ciascun flusso
+#define LAT_BUCKETS 32   // Bucket degli istogrammi di latenza: il bucket k contiene le latenze in [2^(k-1), 2^k) ns, l'ultimo anche quelle maggiori
+#define DEFAULT_FLOWS 2  // Numero di classi di priorità di default: bassa ed alta priorità
 
 #define LOW_PRIORITY 0
 #define HIGH_PRIORITY 1
 
+#define SYNC_WRITE 0
+#define DEFERRED_WRITE 1
+
 #define BLOCKING 0
 #define NON_BLOCKING 1
 
 #define DISABLED 0
 #define ENABLED 1
 
+#define READ_SINGLE 0
+#define READ_ANY 1
+
+#define READ_STRICT 0
+#define READ_WEIGHTED 1
+
+#define LAG_BLOCK 0  // I writer attendono che i consumer group in ritardo recuperino
+#define LAG_DROP 1   // I dati più vecchi vengono scartati per i consumer group in ritardo
+
+#define PREEMPT_NONE 0      // Le scritture delle classi più prioritarie non liberano lo spazio occupato da quelle meno prioritarie
+#define PREEMPT_DEFERRED 1  // Vengono scartate le scritture deferred delle classi meno prioritarie non ancora inserite nei flussi
+#define PREEMPT_EVICT 2     // Vengono scartati anche i dati non ancora letti più vecchi delle classi meno prioritarie
+
+#define DEFERRED_QUEUED 0   // La scrittura deferred è in coda sulla workqueue
+#define DEFERRED_RUNNING 1  // La write_deferred ha iniziato ad eseguire la scrittura, che non può più essere scartata
+#define DEFERRED_DROPPED 2  // La scrittura è stata scartata per liberare spazio ad una classe più prioritaria
+
+#define CHECKPOINT_MAGIC 0x4b43464d  // "MFCK", identifica un file di checkpoint dei flussi
+#define CHECKPOINT_VERSION 1         // Versione del formato del checkpoint
+
+#define RATE_BURST_NS NSEC_PER_SEC  // Crediti massimi accumulabili dai token bucket dei limiti di frequenza: un secondo di operazioni
+
 #define TEST_TIME 15000  // Tempo di attesa prima di rilasciare il lock nella fase di testing
 
 // Codici delle operazioni dev_ioctl
@@ -43,20 +117,44 @@ Mantiene tutti i parametri e le costanti utilizzate all'interno del device drive
 #define SET_BLOCKING_OP 5
 #define SET_NON_BLOCKING_OP 6
 #define SET_TIMEOUT 7
-#define ENABLE_DEV 8   // Attualmente non utilizzato
-#define DISABLE_DEV 9  // Attualmente non utilizzato
-
-// Codici di ritorno
-#define OPEN_ERROR -1
-#define WRITE_ERROR -1
-#define READ_ERROR -1
-#define LOCK_NOT_ACQUIRED -1
+#define ENABLE_DEV 8   // Abilita il dispositivo con il minor passato come parametro
+#define DISABLE_DEV 9  // Disabilita il dispositivo con il minor passato come parametro
+
+// Alias numerici dei comandi MFLOW_IOC_* definiti in mflow_ioctl.h, mantenuti solo per i client esistenti
+#define FLUSH_SESSION 10    // MFLOW_IOC_FLUSH_SESSION
+#define FLUSH_FLOW 11       // MFLOW_IOC_FLUSH_FLOW
+#define GET_LAST_SEQ 12     // MFLOW_IOC_GET_LAST_SEQ
+#define SET_READ_SINGLE 13  // MFLOW_IOC_SET_READ_SINGLE
+#define SET_READ_ANY 14     // MFLOW_IOC_SET_READ_ANY
+#define SET_PRIORITY 15     // MFLOW_IOC_SET_PRIORITY
+#define SET_RCVLOWAT 16     // MFLOW_IOC_SET_RCVLOWAT
+#define SET_MAX_DELAY 17    // MFLOW_IOC_SET_MAX_DELAY
+#define SET_TIMEOUT_NS 18   // MFLOW_IOC_SET_TIMEOUT_NS, con il timeout passato direttamente come parametro
+
+// Stato del timer di max-delay della sessione
+#define DELAY_ARMED 0    // Il timer è stato avviato dall'arrivo di dati sotto il low-watermark
+#define DELAY_EXPIRED 1  // Il timer è scaduto, i dati in coda vanno notificati anche se sotto il low-watermark
+
+// Codici di ritorno. Sono mappati sugli errno standard, in modo che l'utente possa distinguere i diversi casi di errore.
+#define OPEN_ERROR -ENODEV          // Minor non valido
+#define DEV_DISABLED -EPERM         // Dispositivo disabilitato
 #define LOCK_ACQUIRED 0
-#define SCHED_ERROR -1
+#define LOCK_NOT_ACQUIRED -EAGAIN   // Lock non disponibile in un'operazione non bloccante
+#define LOCK_TIMEOUT -ETIMEDOUT     // Timeout scaduto in un'operazione bloccante
+#define NO_DATA -EAGAIN             // Nessun dato da leggere in un'operazione non bloccante
+#define NO_SPACE -ENOSPC            // Spazio insufficiente sul dispositivo
+#define ALLOC_ERROR -ENOMEM         // Errore di allocazione della memoria kernel
+#define COPY_ERROR -EFAULT          // Nessun byte copiato da/verso il buffer utente
+#define BAD_COMMAND -ENOTTY         // Comando ioctl non riconosciuto
+#define SPILL_ERROR -EIO            // Errore di scrittura o lettura del file di spill
+#define CHECKPOINT_ERROR -EIO       // Checkpoint non valido, oppure errore di scrittura o lettura del file di checkpoint
+#define DECOMPRESS_ERROR -EIO       // Dati compressi non validi, oppure compressione non disponibile nel modulo
+#define RATE_LIMITED -EAGAIN        // Limite di frequenza della sessione o del dispositivo esaurito in un'operazione non bloccante
 
 // Modalità di locking in get_lock
 #define TRYLOCK 1
 #define LOCK 2
+#define LOCK_INTERRUPTIBLE 3  // Attesa senza scadenza, interrotta da un segnale (-EINTR)
 
 /**
  *  Parametri del modulo
@@ -65,28 +163,126 @@ unsigned long device_enabling[NUM_DEVICES];
 module_param_array(device_enabling, ulong, NULL, 0660);
 MODULE_PARM_DESC(device_enabling, "Specify if a device file is enabled or disabled. If it is disabled, any attempt to open a session will fail");
 
-unsigned long total_bytes_low[NUM_DEVICES];
-module_param_array(total_bytes_low, ulong, NULL, 0440);
-MODULE_PARM_DESC(total_bytes_low, "Number of bytes yet to be read in the low priority flow.");
+/**
+ *  Configurazione delle classi di priorità. Il numero di classi di ogni dispositivo e la semantica di scrittura di ciascuna classe
+ *  vengono letti al caricamento del modulo. Le classi sono ordinate per priorità crescente: la classe 0 è la meno prioritaria.
+ */
+unsigned long device_flows[NUM_DEVICES];
+module_param_array(device_flows, ulong, NULL, 0440);
+MODULE_PARM_DESC(device_flows, "Number of priority classes of each device [1-8]. Devices with an invalid value use 2 classes.");
+
+unsigned long flow_mode[MAX_FLOWS] = {DEFERRED_WRITE, SYNC_WRITE, SYNC_WRITE, SYNC_WRITE, SYNC_WRITE, SYNC_WRITE, SYNC_WRITE, SYNC_WRITE};
+module_param_array(flow_mode, ulong, NULL, 0440);
+MODULE_PARM_DESC(flow_mode, "Write semantics of each priority class: 0 synchronous, 1 deferred.");
 
-unsigned long total_bytes_high[NUM_DEVICES];
-module_param_array(total_bytes_high, ulong, NULL, 0440);
-MODULE_PARM_DESC(total_bytes_high, "Number of bytes yet to be read in the high priority flow.");
+unsigned long flow_weight[MAX_FLOWS] = {1, 1, 1, 1, 1, 1, 1, 1};
+module_param_array(flow_weight, ulong, NULL, 0660);
+MODULE_PARM_DESC(flow_weight, "Weight of each priority class in the weighted-fair read scheduler.");
 
-unsigned long waiting_threads_low[NUM_DEVICES];
-module_param_array(waiting_threads_low, ulong, NULL, 0440);
-MODULE_PARM_DESC(waiting_threads_low, "Number of threads waiting for data on the low priority flow.");
+unsigned long flow_sharded[MAX_FLOWS];
+module_param_array(flow_sharded, ulong, NULL, 0440);
+MODULE_PARM_DESC(flow_sharded, "Per-CPU sharded submission for each synchronous priority class: 0 disabled, 1 enabled.");
 
-unsigned long waiting_threads_high[NUM_DEVICES];
-module_param_array(waiting_threads_high, ulong, NULL, 0440);
-MODULE_PARM_DESC(waiting_threads_high, "Number of threads waiting for data on the high priority flow.");
+unsigned long flow_ttl_ms[MAX_FLOWS];
+module_param_array(flow_ttl_ms, ulong, NULL, 0660);
+MODULE_PARM_DESC(flow_ttl_ms, "Milliseconds after which unread data of each priority class is discarded (0 = never).");
 
-// Ritorna la stringa associata ad un codice di priorità
+/**
+ *  Politica con cui una scrittura che non trova spazio sul dispositivo lo libera a spese delle classi meno prioritarie della propria
+ */
+int preempt_policy = PREEMPT_NONE;
+module_param(preempt_policy, int, 0660);
+MODULE_PARM_DESC(preempt_policy, "How a write that finds the device full reclaims space from lower priority classes: 0 never, 1 drop their queued deferred writes, 2 also evict their oldest unread data.");
+
+/**
+ *  Limiti di frequenza aggregati di ciascun dispositivo, condivisi da tutte le sessioni: bytes scritti al secondo e operazioni (letture e scritture)
+ *  al secondo (0 = nessun limite). Le singole sessioni possono avere limiti propri, impostati tramite MFLOW_IOC_SET_RATE_LIMIT.
+ */
+unsigned long device_rate_bytes[NUM_DEVICES];
+module_param_array(device_rate_bytes, ulong, NULL, 0660);
+MODULE_PARM_DESC(device_rate_bytes, "Bytes per second all sessions of each device may write together (0 = unlimited).");
+unsigned long device_rate_ops[NUM_DEVICES];
+module_param_array(device_rate_ops, ulong, NULL, 0660);
+MODULE_PARM_DESC(device_rate_ops, "Reads and writes per second all sessions of each device may issue together (0 = unlimited).");
+
+/**
+ *  File in cui vengono salvati i dati in coda allo smontaggio del modulo, e da cui vengono ricaricati al montaggio successivo (vuoto = disabilitato)
+ */
+char *checkpoint_path = NULL;
+module_param(checkpoint_path, charp, 0660);
+MODULE_PARM_DESC(checkpoint_path, "File where queued flow data is saved on unload and restored from on load (unset disables).");
+
+/**
+ *  Overflow su file: a dispositivo pieno le scritture di una classe non sharded vengono salvate in un file shmem del flusso,
+ *  fino a flow_spill_bytes bytes per classe (0 = le scritture falliscono con ENOSPC). I lettori rileggono il file a blocchi di spill_read_chunk bytes.
+ */
+unsigned long flow_spill_bytes[MAX_FLOWS];
+module_param_array(flow_spill_bytes, ulong, NULL, 0660);
+MODULE_PARM_DESC(flow_spill_bytes, "Maximum bytes each non-sharded priority class may spill to a shmem-backed file when the device is full (0 disables spilling).");
+unsigned long spill_read_chunk = 262144;
+module_param(spill_read_chunk, ulong, 0660);
+MODULE_PARM_DESC(spill_read_chunk, "Bytes of consecutive spilled writes read back at once when a reader reaches them.");
+
+/**
+ *  Limiti sulle scritture deferred in attesa di essere eseguite sui flussi deferred del dispositivo (0 = nessun limite)
+ */
+unsigned long max_deferred_items = 1024;
+module_param(max_deferred_items, ulong, 0660);
+MODULE_PARM_DESC(max_deferred_items, "Maximum number of deferred writes pending on the deferred flows of a device.");
+
+unsigned long max_deferred_bytes = MAX_SIZE_BYTES / 4;
+module_param(max_deferred_bytes, ulong, 0660);
+MODULE_PARM_DESC(max_deferred_bytes, "Maximum number of bytes held by deferred writes pending on the deferred flows of a device.");
+
+/**
+ *  Compressione LZ4 delle scritture deferred di almeno deferred_compress_min bytes, eseguita dalla write_deferred prima di inserire i dati nel flusso.
+ *  Senza la libreria LZ4 nel kernel il parametro viene ignorato.
+ */
+int deferred_compress = 0;
+module_param(deferred_compress, int, 0660);
+MODULE_PARM_DESC(deferred_compress, "Compress deferred writes with LZ4 before appending them to the flow: 0 disabled, 1 enabled.");
+unsigned long deferred_compress_min = 256;
+module_param(deferred_compress_min, ulong, 0660);
+MODULE_PARM_DESC(deferred_compress_min, "Deferred writes smaller than this many bytes are stored uncompressed.");
+
+/**
+ *  Le scritture di almeno large_write_threshold bytes vengono memorizzate in pagine singole invece che in un buffer contiguo (0 = disabilitato)
+ */
+unsigned long large_write_threshold = 65536;
+module_param(large_write_threshold, ulong, 0660);
+MODULE_PARM_DESC(large_write_threshold, "Writes of at least this many bytes are stored in single pages instead of a contiguous buffer (0 disables).");
+
+/**
+ *  Nodo NUMA su cui allocare lo stato dei dispositivi. Con -1 lo stato viene allocato sul nodo del primo processo che apre il dispositivo.
+ */
+int device_node = NUMA_NO_NODE;
+module_param(device_node, int, 0660);
+MODULE_PARM_DESC(device_node, "NUMA node for the per-device state. -1 allocates it on the node of the first opener.");
+
+/**
+ *  Nanosecondi massimi di attesa attiva del lock da parte di un'operazione bloccante, prima di essere messa in sleep (0 = disabilitata)
+ */
+unsigned long lock_spin_ns = 5000;
+module_param(lock_spin_ns, ulong, 0660);
+MODULE_PARM_DESC(lock_spin_ns, "Maximum nanoseconds a blocking operation spins on a busy flow lock, while its owner is running, before sleeping (0 disables).");
+
+/**
+ *  Massimo ritardo in bytes di un consumer group rispetto alla coda del flusso (0 = nessun limite), e politica applicata al suo superamento
+ */
+unsigned long group_max_lag = 0;
+module_param(group_max_lag, ulong, 0660);
+MODULE_PARM_DESC(group_max_lag, "Maximum bytes a consumer group may lag behind the tail of its flow (0 = unlimited).");
+int group_lag_policy = LAG_BLOCK;
+module_param(group_lag_policy, int, 0660);
+MODULE_PARM_DESC(group_lag_policy, "What happens when a consumer group exceeds group_max_lag: 0 blocks the writers, 1 drops the oldest data for that group.");
+
+// Ritorna la stringa associata ad una classe di priorità
 char* get_prio_str(int code) {
-    if (code == 0) {
-        return "LOW_PRIORITY";
+    static char* names[MAX_FLOWS] = {"PRIORITY_0", "PRIORITY_1", "PRIORITY_2", "PRIORITY_3", "PRIORITY_4", "PRIORITY_5", "PRIORITY_6", "PRIORITY_7"};
+    if (code < 0 || code >= MAX_FLOWS) {
+        return "INVALID_PRIORITY";
     }
-    return "HIGH_PRIORITY";
+    return names[code];
 }
 
 // Ritorna la stringa associata ad un codice per operazioni bloccanti o non-bloccanti
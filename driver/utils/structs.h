@@ -16,46 +16,219 @@ Mantiene tutte le strutture utilizzate all'interno del device driver
 typedef struct _stream_block {
     int read_offset;             // Mantiene l'offset di lettura del blocco corrente
     char *stream_content;        // Il nodo di I/O è un buffer di memoria, che viene puntato tramite questo campo
+    struct page **pages;         // Pagine che contengono i dati di una scrittura grande, in alternativa a stream_content
+    unsigned int nr_pages;       // Numero di elementi dell'array pages
+    size_t size;                 // Numero di bytes di dati contenuti nel blocco
+    size_t stored_size;          // Bytes compressi con LZ4 in stream_content, 0 se i dati non sono compressi
+    int spilled;                 // I dati del blocco si trovano nel file di spill del flusso, e non in memoria
+    loff_t spill_pos;            // Offset dei dati del blocco nel file di spill
     struct _stream_block *next;  // Puntatore al blocco di stream successivo
     int id;                      // ID progressivo del blocco, utile per debugging
+    u64 seq;                     // Numero di sequenza della scrittura contenuta nel blocco
+    u64 start;                   // Posizione assoluta nel flusso del primo byte del blocco
+    u64 enqueue_ns;              // Istante di sottomissione della scrittura (CLOCK_MONOTONIC), all'ingresso della dev_write
+    u64 visible_ns;              // Istante in cui la scrittura è diventata leggibile nello stream
 } stream_block;
 
 /**
- * Mantinene tutte le informazioni sul singolo flusso di priorità
+ * Buffer di sottomissione per-CPU di un flusso sharded. I writer accodano i propri blocchi nello shard della CPU corrente,
+ * i lettori li spostano nello stream del flusso. Ogni shard occupa una propria cache line.
+ */
+typedef struct _flow_shard {
+    spinlock_t lock;      // Sincronizza i writer della CPU con il lettore che svuota lo shard
+    stream_block *head;   // Primo blocco accodato nello shard, con numero di sequenza minimo
+    stream_block *tail;   // Ultimo blocco accodato nello shard
+    unsigned long bytes;  // Bytes accodati nello shard e non ancora spostati nello stream
+} ____cacheline_aligned_in_smp flow_shard;
+
+/**
+ * Consumer group di un flusso. Le sessioni del gruppo condividono un cursore di lettura indipendente da quello degli altri gruppi
+ * e dai lettori distruttivi del flusso: i dati restano nello stream finché non sono stati letti da tutti.
+ */
+typedef struct _consumer_group {
+    char name[MFLOW_GROUP_NAME_LEN];  // Nome del gruppo
+    int members;                      // Sessioni nel gruppo, 0 se lo slot è libero
+    stream_block *block;              // Blocco dello stream a cui punta il cursore del gruppo
+    size_t offset;                    // Offset di lettura del gruppo nel blocco corrente
+    u64 pos;                          // Posizione assoluta del cursore nel flusso
+    unsigned long dropped;            // Bytes scartati per il gruppo a causa del superamento di group_max_lag o del TTL del flusso
+} consumer_group;
+
+/**
+ * Mantinene tutte le informazioni sul singolo flusso di priorità. I campi sono raggruppati in cache line distinte in base a chi li modifica:
+ * i campi dei writer, quelli dei lettori e le statistiche non devono condividere la stessa cache line (false sharing).
  */
 typedef struct _flow_state {
-    struct mutex operation_synchronizer;  // Lock sullo specifico device, per sincronizzare l'accesso di thread concorrenti
-    stream_block *head;                   // Puntatore al primo blocco dati dello stream
-    stream_block *tail;                   // Puntatore all' ultimo blocco dati dello stream. Permette di appendere più velocemente un nuovo stream block.
-    wait_queue_head_t wait_queue;         // Wait Event Queue, mantiene i task bloccanti messi in sleep.
-} flow_state;
+    // Sincronizzazione
+    struct mutex operation_synchronizer;                         // Lock sullo specifico device, per sincronizzare l'accesso di thread concorrenti
+    wait_queue_head_t wait_queue;                                // Wait Event Queue, mantiene i task bloccanti messi in sleep.
+    struct task_struct *lock_owner;                              // Task che possiede il lock, NULL se libero. Usato dall'attesa attiva adattiva.
+
+    // Lato writer
+    stream_block *tail ____cacheline_aligned_in_smp;             // Puntatore all' ultimo blocco dati dello stream. Permette di appendere più velocemente un nuovo stream block.
+    u64 submitted_seq;                                           // Numero di sequenza dell'ultima scrittura sottomessa al flusso. Aggiornato solo possedendo il lock.
+    atomic64_t completed_seq;                                    // Numero di sequenza dell'ultima scrittura resa visibile nello stream.
+    flow_shard __percpu *shards;                                 // Buffer di sottomissione per-CPU, NULL se il flusso non è sharded.
+    atomic64_t shard_seq;                                        // Numero di sequenza dell'ultima scrittura accodata in uno degli shard.
+    u64 tail_pos;                                                // Posizione assoluta della fine dei dati visibili nello stream. Aggiornata solo possedendo il lock.
+    struct file *spill_file;                                     // File shmem delle scritture in overflow, creato al primo utilizzo.
+    loff_t spill_tail;                                           // Offset del file di spill a cui viene salvata la prossima scrittura.
+    unsigned long spill_bytes;                                   // Bytes dei blocchi che si trovano nel file di spill. Aggiornato solo possedendo il lock.
+    unsigned long spill_pending;                                 // Bytes delle scritture deferred in coda destinate al file di spill. Aggiornato solo possedendo il lock.
+    struct list_head deferred;                                   // Scritture deferred in coda e non ancora inserite nello stream, dalla più vecchia. Aggiornata solo possedendo il lock.
+
+    // Lato lettore
+    stream_block *head ____cacheline_aligned_in_smp;             // Puntatore al primo blocco dati dello stream
+    unsigned long ready_bytes;                                   // Bytes effettivamente presenti nello stream e leggibili. Aggiornato solo possedendo il lock.
+    unsigned long total_bytes;                                   // Bytes ancora da leggere nel flusso, comprese le scritture deferred non ancora eseguite.
+    u64 merged_seq;                                              // Numero di sequenza dell'ultima scrittura spostata dagli shard allo stream. Aggiornato solo possedendo il lock.
+    stream_block *pending;                                       // Blocchi estratti dagli shard in attesa dei numeri di sequenza precedenti, ordinati per sequenza.
+    unsigned long pending_bytes;                                 // Bytes dei blocchi nella lista pending. Aggiornato solo possedendo il lock.
+    stream_block *retained;                                      // Blocco più vecchio ancora nello stream: precede head se un consumer group non lo ha ancora letto.
+    u64 head_pos;                                                // Posizione assoluta del cursore dei lettori distruttivi.
+    u64 released_pos;                                            // Posizione fino a cui i dati sono stati letti da tutti ed il relativo spazio è stato rilasciato.
+    consumer_group groups[MAX_GROUPS];                           // Cursori dei consumer group del flusso. Aggiornati solo possedendo il lock.
+
+    // Statistiche, aggiornate atomicamente anche senza possedere il lock
+    unsigned long waiting_threads ____cacheline_aligned_in_smp;  // Numero di thread in attesa di dati o del lock sul flusso.
+    atomic_long_t spin_acquired;                                 // Attese attive concluse acquisendo il lock, senza sleep.
+    atomic_long_t spin_failed;                                   // Attese attive concluse senza lock, seguite dalla sleep in waitqueue.
+    unsigned long visible_hist[LAT_BUCKETS];                     // Istogramma della latenza submit→visible delle scritture. Aggiornato solo possedendo il lock.
+    unsigned long read_hist[LAT_BUCKETS];                        // Istogramma della latenza visible→read dei blocchi, per ogni cursore che li legge. Aggiornato solo possedendo il lock.
+    unsigned long expired_bytes;                                 // Bytes scartati senza essere letti dai lettori distruttivi perché più vecchi di flow_ttl_ms.
+    unsigned long preempted_bytes;                               // Bytes scartati senza essere letti per liberare spazio alle classi più prioritarie.
+} ____cacheline_aligned_in_smp flow_state;
+
+/**
+ * Token bucket dei limiti di frequenza, nella forma di GCRA: per ciascun limite si mantiene l'istante teorico in cui il bucket torna pieno,
+ * che ogni operazione ammessa sposta in avanti del proprio costo. Un'operazione viene ammessa finché il debito non supera RATE_BURST_NS.
+ */
+typedef struct _rate_bucket {
+    spinlock_t lock;          // Sincronizza le operazioni concorrenti che usano il bucket
+    u64 bytes_tat;            // Istante teorico in cui il bucket dei bytes torna pieno
+    u64 ops_tat;              // Istante teorico in cui il bucket delle operazioni torna pieno
+    atomic_long_t throttled;  // Operazioni rallentate o rifiutate
+    atomic64_t throttled_ns;  // Nanosecondi trascorsi in attesa dalle operazioni rallentate
+} rate_bucket;
 
 /**
- * Mantinene lo stato del device
+ * Mantinene lo stato del device. Lo stato viene allocato alla prima apertura del dispositivo, sul nodo NUMA del processo che lo apre
+ * oppure su quello configurato tramite il parametro device_node.
  */
 typedef struct _object_state {
-    long available_bytes;                 // Mantiene lo spazio libero totale del dispositivo, a prescindere dai due flussi.
-    flow_state priority_flow[NUM_FLOWS];  // Mantiene lo stato complessivo del flusso ad alta e bassa priorità
+    // Configurazione, non modificata dopo l'allocazione
+    int num_flows;                                               // Numero di classi di priorità del dispositivo [1,MAX_FLOWS]
+    int node;                                                    // Nodo NUMA su cui è allocato lo stato del dispositivo
+    struct workqueue_struct *deferred_wq;                        // Workqueue ordinata delle scritture deferred: le scritture diventano visibili nell'ordine di sottomissione.
+
+    // Spazio libero, modificato sia dai writer che dai lettori
+    atomic_long_t available_bytes ____cacheline_aligned_in_smp;  // Mantiene lo spazio libero totale del dispositivo, a prescindere dai flussi.
+
+    // Lettori in attesa di dati
+    wait_queue_head_t data_queue ____cacheline_aligned_in_smp;   // Mantiene i lettori in attesa di dati su uno qualsiasi dei flussi del dispositivo.
+
+    // Coda delle scritture deferred, modificata dai writer deferred e dalla write_deferred
+    atomic_long_t deferred_depth ____cacheline_aligned_in_smp;   // Numero di scritture deferred non ancora inserite nei flussi
+    atomic_long_t deferred_bytes;                                // Bytes delle scritture deferred non ancora inserite nei flussi
+    unsigned long deferred_peak;                                 // Massimo numero di scritture deferred in coda contemporaneamente
+    atomic_long_t deferred_throttled;                            // Scritture deferred rallentate o rifiutate perché la coda era piena
+    void *lz4_wrkmem;                                            // Memoria di lavoro della compressione LZ4, usata solo dalla workqueue ordinata
+    unsigned long compress_in;                                   // Bytes delle scritture deferred compresse, prima della compressione
+    unsigned long compress_out;                                  // Bytes occupati dalle scritture deferred compresse, dopo la compressione
+
+    // Scadenza dei dati più vecchi del TTL della propria classe
+    struct delayed_work reaper;                                  // Lavoro periodico che scarta i dati scaduti anche in assenza di letture e scritture
+
+    // Limiti di frequenza aggregati delle sessioni del dispositivo
+    rate_bucket rate ____cacheline_aligned_in_smp;               // Token bucket dei limiti device_rate_bytes e device_rate_ops
+
+    flow_state priority_flow[MAX_FLOWS];                         // Mantiene lo stato complessivo di ciascuna classe di priorità
 } object_state;
 
 /**
  * Mantiene lo stato della sessione
  */
 typedef struct _session_state {
-    int blocking;  // Operazioni bloccanti o non-bloccanti [0,1] = [blocking,non-blocking]
-    int priority;  // Livello di priorità della sessione [0,1] = [low,high]
-    int timeout;   // Timeout per il risveglio dei thread in wait_queue [>0]
+    int blocking;                   // Operazioni bloccanti o non-bloccanti [0,1] = [blocking,non-blocking]
+    int priority;                   // Classe di priorità della sessione [0,num_flows-1], la classe 0 è la meno prioritaria
+    u64 timeout;                    // Timeout in nanosecondi delle operazioni bloccanti, misurato dall'inizio di ciascuna operazione [0 = nessuna attesa]
+    u64 deadline_ns;                // Scadenza assoluta (CLOCK_MONOTONIC) delle operazioni bloccanti, combinata con il timeout [0 = nessuna scadenza]
+    int minor;                      // Minor number del device a cui è associata la sessione
+    int read_mode;                  // Modalità di lettura [0,1] = [solo il flusso della sessione, tutti i flussi]
+    int scheduler;                  // Scheduler delle letture READ_ANY [0,1] = [priorità stretta, weighted-fair]
+    long sched_credit[MAX_FLOWS];   // Crediti correnti di ciascuna classe nello scheduler weighted-fair
+    int last_flow;                  // Flusso su cui è stata effettuata l'ultima scrittura della sessione
+    u64 last_seq;                   // Numero di sequenza dell'ultima scrittura della sessione
+    u64 synced_seq;                 // Ultimo numero di sequenza di cui è stato notificato il completamento tramite flush
+    unsigned long rcvlowat;         // Bytes minimi in coda per risvegliare la sessione, come SO_RCVLOWAT [0,1] = qualsiasi quantità di dati
+    unsigned long max_delay;        // Millisecondi massimi di attesa dei dati sotto il low-watermark prima di risvegliare la sessione [0 = nessun limite]
+    int relay_active;               // La sessione è registrata nella data_queue del dispositivo tramite relay
+    wait_queue_entry_t relay;       // Elemento della data_queue che inoltra i risvegli dei writer alla poll_queue, solo al raggiungimento della soglia
+    wait_queue_head_t poll_queue;   // Lettori bloccanti e poll() della sessione, quando il relay è attivo
+    struct mutex relay_lock;        // Serializza le modifiche di rcvlowat e max-delay con la registrazione del relay
+    struct hrtimer delay_timer;     // Timer di max-delay, avviato dall'arrivo di dati sotto il low-watermark
+    unsigned long delay_flags;      // Stato del timer di max-delay [DELAY_ARMED, DELAY_EXPIRED]
+    int group;                      // Consumer group della sessione nel flusso group_flow [-1 = lettura distruttiva]
+    int group_flow;                 // Flusso del consumer group della sessione
+    int peek;                       // Le letture copiano i dati senza consumarli, fino ad una MFLOW_IOC_COMMIT [0,1]
+    u64 read_enqueue_ns;            // Istante di sottomissione del primo messaggio dell'ultima lettura, restituito da MFLOW_IOC_GET_READ_TIMES
+    u64 read_visible_ns;            // Istante in cui il primo messaggio dell'ultima lettura è diventato leggibile
+    u64 rate_bytes;                 // Bytes scritti al secondo dalla sessione [0 = nessun limite]
+    u64 rate_ops;                   // Letture e scritture al secondo della sessione [0 = nessun limite]
+    rate_bucket rate;               // Token bucket dei limiti di frequenza della sessione
 } session_state;
 
+/**
+ * Formato del file di checkpoint. Il file contiene un checkpoint_header, seguito per ciascun dispositivo da un checkpoint_device e,
+ * per ciascuna delle sue classi, da un checkpoint_flow con i blocchi non ancora letti: ogni checkpoint_block è seguito dai dati del blocco,
+ * compressi se il blocco era compresso. I numeri sono nell'ordine dei byte della macchina, il checkpoint è pensato per il ricaricamento del modulo.
+ */
+typedef struct _checkpoint_header {
+    u32 magic;        // CHECKPOINT_MAGIC
+    u32 version;      // CHECKPOINT_VERSION
+    u32 lat_buckets;  // LAT_BUCKETS del modulo che ha scritto il checkpoint
+    u32 devices;      // Numero di dispositivi salvati, scritto solo a checkpoint completato
+} checkpoint_header;
+
+typedef struct _checkpoint_device {
+    u32 minor;                // Minor number del dispositivo
+    u32 num_flows;            // Numero di classi di priorità salvate
+    u64 deferred_peak;        // Statistiche della coda deferred
+    u64 deferred_throttled;
+    u64 compress_in;          // Statistiche della compressione
+    u64 compress_out;
+} checkpoint_device;
+
+typedef struct _checkpoint_flow {
+    u64 blocks;                     // Numero di blocchi salvati
+    u64 seq;                        // Numero di sequenza dell'ultima scrittura del flusso
+    u64 expired_bytes;              // Statistiche del flusso
+    u64 spin_acquired;
+    u64 spin_failed;
+    u64 visible_hist[LAT_BUCKETS];  // Istogrammi di latenza del flusso
+    u64 read_hist[LAT_BUCKETS];
+} checkpoint_flow;
+
+typedef struct _checkpoint_block {
+    u64 seq;          // Numero di sequenza della scrittura
+    u64 enqueue_ns;   // Istanti di sottomissione e di visibilità della scrittura, in CLOCK_MONOTONIC che prosegue tra i montaggi del modulo
+    u64 visible_ns;
+    u32 size;         // Bytes non ancora letti del blocco
+    u32 stored_size;  // Bytes compressi che seguono il record, 0 se seguono 'size' bytes non compressi
+} checkpoint_block;
+
 /**
  *  Struttura utilizzata nel meccanismo di deferred work
  */
 typedef struct _packed_work_struct {
-    const char *data;         // Puntatore al buffer kernel temporaneo dove sono salvati i dati da scrivere poi sullo stream.
-    stream_block *new_block;  // Puntatore al blocco vuoto per la scrittura successiva.
+    stream_block *new_block;  // Blocco temporaneo con i dati da scrivere, diventa il blocco vuoto in coda allo stream dopo la scrittura.
     int minor;                // Minor number del device su cui si sta operando.
-    size_t len;               // Quantità di dati da scrivere, corrisponde alla lunghezza del buffer 'data'.
-    session_state *session;   // Puntatore alla session_state verso il device su cui effettuare la scrittura.
+    int priority;             // Classe di priorità del flusso su cui effettuare la scrittura.
+    size_t len;               // Quantità di dati da scrivere, corrisponde alla dimensione del blocco 'new_block'.
+    u64 seq;                  // Numero di sequenza della scrittura nel flusso.
+    int spill;                // La scrittura non ha spazio riservato sul dispositivo e va salvata nel file di spill del flusso.
+    atomic_t state;           // Stato della scrittura [DEFERRED_QUEUED, DEFERRED_RUNNING, DEFERRED_DROPPED]
+    struct list_head node;    // Elemento della lista delle scritture deferred in coda sul flusso
     struct work_struct work;  // Struttura di deferred work
 } packed_work_struct;
 
@@ -20,25 +20,82 @@ Funzioni e macro ausiliarie utilizzate nel device driver
 #endif
 
 /**
- * Inserisce un task in waitqueue, cercando di ottenere il lock ad ogni wake_up() fino allo scadere del timeout.
- * Ritorna 1 se il lock è stato acquisito, 0 se il timeout è scaduto senza acquisire il lock
+ * Macro per ottenere il payload di un comando io_uring passthrough, in base alla versione del kernel utilizzata
  */
-int put_to_waitqueue(unsigned long timeout, struct mutex *mutex, wait_queue_head_t *wq) {
+#ifdef HAVE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define get_uring_payload(ioucmd) io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define get_uring_payload(ioucmd) ((const void *)(ioucmd)->cmd)
+#endif
+#endif
+
+/**
+ * Macro per inizializzare un hrtimer relativo su CLOCK_MONOTONIC, in base alla versione del kernel utilizzata
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define setup_rel_hrtimer(timer, callback) hrtimer_setup(timer, callback, CLOCK_MONOTONIC, HRTIMER_MODE_REL)
+#else
+#define setup_rel_hrtimer(timer, callback)                          \
+    do {                                                            \
+        hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);     \
+        (timer)->function = callback;                               \
+    } while (0)
+#endif
+
+/**
+ * Calcola la scadenza assoluta di un'operazione della sessione. Il timeout viene convertito una sola volta all'inizio dell'operazione,
+ * così che tutte le attese successive (lock, dati, coda deferred, flush) condividano la stessa scadenza e i tentativi ripetuti non allunghino l'attesa.
+ * Se la sessione ha anche una scadenza assoluta (deadline_ns) viene usata la più vicina delle due.
+ * Ritorna 0 se la sessione non ha né timeout né scadenza: tutte le attese del driver interpretano 0 come "nessuna attesa".
+ */
+ktime_t get_deadline(session_state *session) {
+    ktime_t deadline = 0;
+    ktime_t absolute = (ktime_t)READ_ONCE(session->deadline_ns);
+
+    if (session->timeout != 0) {
+        deadline = ktime_add_safe(ktime_get(), ns_to_ktime(min_t(u64, session->timeout, KTIME_MAX)));
+    }
+    if (absolute != 0 && (deadline == 0 || absolute < deadline)) {
+        deadline = absolute;
+    }
+    return deadline;
+}
+
+/**
+ * Ritorna il tempo rimanente prima della scadenza, oppure 0 se la scadenza è già passata.
+ */
+ktime_t time_left(ktime_t deadline) {
+    ktime_t left = ktime_sub(deadline, ktime_get());
+    return ktime_to_ns(left) > 0 ? left : 0;
+}
+
+/**
+ * Inserisce un task in waitqueue, cercando di ottenere il lock ad ogni wake_up() fino alla scadenza assoluta 'deadline'.
+ * L'attesa usa un hrtimer, quindi la risoluzione non è limitata ai jiffies.
+ * Ritorna 1 se il lock è stato acquisito, 0 se la scadenza è passata senza acquisire il lock
+ */
+int put_to_waitqueue(ktime_t deadline, struct mutex *mutex, wait_queue_head_t *wq) {
     int val;
-    if (timeout == 0) {
+    ktime_t left;
+    if (deadline == 0) {
+        return 0;
+    }
+    left = time_left(deadline);
+    if (left == 0) {
         return 0;
     }
 
-    printk(KERN_INFO "%s: Thread %d will sleep for %lu ms\n", MODNAME, current->pid, timeout);
+    printk(KERN_INFO "%s: Thread %d will sleep for %lld ns\n", MODNAME, current->pid, ktime_to_ns(left));
 
     // Si mette in sleep il processo finché la condizione non è True. La condizione viene verificata ogni volta che la waitqueue viene risvegliata.
-    // Ritorna il numero di jiffies rimenenti (>=1) se la condizione viene verificata, 0 se resta False fino allo scadere del timeout
-    val = wait_event_timeout(*wq, mutex_trylock(mutex), msecs_to_jiffies(timeout));
+    // Ritorna 0 se la condizione viene verificata, -ETIME se resta False fino allo scadere del timer
+    val = wait_event_hrtimeout(*wq, mutex_trylock(mutex), left);
 
     printk(KERN_INFO "%s: Thread %d awaken\n", MODNAME, current->pid);
 
     // Non è stato acquisito il lock
-    if (val == 0) {
+    if (val != 0) {
         printk("%s: Thread %d timeout elapsed. Lock not acquired\n", MODNAME, current->pid);
         return 0;
     }
@@ -48,47 +105,129 @@ int put_to_waitqueue(unsigned long timeout, struct mutex *mutex, wait_queue_head
 }
 
 /**
- * Prova ad acquisire il lock sul mutex. Il comportamento varia a seconda del tipo di operazione.
+ * Ritorna il tipo di operazione effettivo per la sessione. Il flag O_NONBLOCK, impostato tramite open() o fcntl(),
+ * rende non bloccante l'operazione anche se la sessione è stata configurata come bloccante tramite ioctl.
+ * Allo stesso modo le richieste IOCB_NOWAIT (io_uring, RWF_NOWAIT) non devono mai mettere in attesa il chiamante.
+ */
+int get_blocking(session_state *session, struct kiocb *iocb) {
+    if (iocb->ki_filp->f_flags & O_NONBLOCK || iocb->ki_flags & IOCB_NOWAIT) {
+        return NON_BLOCKING;
+    }
+    return session->blocking;
+}
+
+/**
+ * Verifica se il possessore del lock è in esecuzione su una CPU (e, in una macchina virtuale, se la sua vCPU non è stata prelazionata).
+ * Va chiamata in una sezione RCU, che garantisce la validità della task_struct del possessore.
+ */
+int lock_owner_running(struct task_struct *owner) {
+#ifdef CONFIG_SMP
+    return READ_ONCE(owner->on_cpu) && !vcpu_is_preempted(task_cpu(owner));
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Attesa attiva adattiva del lock di un flusso, prima di mettere il task in sleep. Le sezioni critiche dei flussi sono brevi (una copia di
+ * pochi bytes), quindi finché il possessore del lock è in esecuzione conviene riprovare il trylock invece di pagare il costo di sleep e wake_up.
+ * L'attesa dura al massimo lock_spin_ns nanosecondi, senza superare la scadenza dell'operazione, e termina subito se il possessore viene
+ * deschedulato o se il task corrente deve cedere la CPU.
+ * Ritorna 1 se il lock è stato acquisito, 0 altrimenti.
+ */
+int spin_for_lock(flow_state *the_flow, ktime_t deadline) {
+    struct task_struct *owner;
+    u64 limit;
+    int acquired = 0;
+    unsigned long spin_ns = READ_ONCE(lock_spin_ns);
+
+    if (spin_ns == 0) {
+        return 0;
+    }
+    limit = ktime_get_ns() + spin_ns;
+    if (deadline != 0 && ktime_to_ns(deadline) < limit) {
+        limit = ktime_to_ns(deadline);
+    }
+
+    rcu_read_lock();
+    while (!need_resched() && ktime_get_ns() < limit) {
+        if (mutex_trylock(&the_flow->operation_synchronizer)) {
+            acquired = 1;
+            break;
+        }
+        // Il possessore non è in esecuzione: il lock non verrà rilasciato a breve
+        owner = READ_ONCE(the_flow->lock_owner);
+        if (owner != NULL && !lock_owner_running(owner)) {
+            break;
+        }
+        cpu_relax();
+    }
+    rcu_read_unlock();
+
+    atomic_long_inc(acquired ? &the_flow->spin_acquired : &the_flow->spin_failed);
+    return acquired;
+}
+
+/**
+ * Prova ad acquisire il lock sul mutex del flusso specificato. Il comportamento varia a seconda del tipo di operazione.
  * - Se l'operazione è una scrittura low priority si usa mutex_lock per attendere di prendere il lock.
  * - Se l'operazione è non bloccante e il lock non viene acquisito nel trylock, l'operazione fallisce.
- * - Se l'operazione è bloccante ed il lock non viene acquisito, il task viene messo nella waitqueue.
- * Ritorna 0 se il lock viene acquisito correttamente, -1 se il lock non viene acquisito.
+ * - Se l'operazione è bloccante ed il lock non viene acquisito, si attende attivamente tramite spin_for_lock finché il possessore è in esecuzione,
+ *   e solo dopo il task viene messo nella waitqueue.
+ * - Con LOCK_INTERRUPTIBLE si attende il lock senza scadenza, ma l'attesa viene interrotta da un segnale.
+ * Ritorna LOCK_ACQUIRED se il lock viene acquisito, LOCK_NOT_ACQUIRED (-EAGAIN) per operazioni non bloccanti,
+ * LOCK_TIMEOUT (-ETIMEDOUT) se la scadenza di un'operazione bloccante passa senza acquisire il lock e -EINTR se l'attesa viene interrotta.
  */
-int get_lock(object_state *the_object, session_state *session, int minor, int lock_type) {
+int get_lock(object_state *the_object, int minor, int priority, int blocking, ktime_t deadline, int lock_type) {
     int lock;
     int ret;
-    int priority;
+    unsigned long *waiting_threads;
     wait_queue_head_t *wq;
     flow_state *the_flow;
-    priority = session->priority;
     the_flow = &the_object->priority_flow[priority];
     wq = &the_flow->wait_queue;
+    waiting_threads = &the_flow->waiting_threads;
 
     // Una scrittura low priority non può fallire, quindi il processo attende attivamente di ottenere il lock prima della write_on_stream.
     if (lock_type == LOCK) {
         printk(KERN_INFO "%s: Process %d actively waiting to get lock.\n", MODNAME, current->pid);
-        __sync_fetch_and_add(&waiting_threads_low[minor], 1);
+        __sync_fetch_and_add(waiting_threads, 1);
         mutex_lock(&(the_flow->operation_synchronizer));
-        __sync_fetch_and_add(&waiting_threads_low[minor], -1);
+        __sync_fetch_and_add(waiting_threads, -1);
+        WRITE_ONCE(the_flow->lock_owner, current);
         printk(KERN_INFO "%s: Process %d acquired lock.\n", MODNAME, current->pid);
         return LOCK_ACQUIRED;
     }
+    if (lock_type == LOCK_INTERRUPTIBLE) {
+        __sync_fetch_and_add(waiting_threads, 1);
+        ret = mutex_lock_interruptible(&(the_flow->operation_synchronizer));
+        __sync_fetch_and_add(waiting_threads, -1);
+        if (ret != 0) {
+            return -EINTR;
+        }
+        WRITE_ONCE(the_flow->lock_owner, current);
+        return LOCK_ACQUIRED;
+    }
 
     // Operazioni sincrone, si effettua il trylock
     lock = mutex_trylock(&(the_flow->operation_synchronizer));
 
+    if (lock == 0 && blocking == BLOCKING) {
+        lock = spin_for_lock(the_flow, deadline);
+    }
+
     if (lock == 0) {
         printk("%s: Lock not available.\n", MODNAME);
-        if (session->blocking == BLOCKING) {
+        if (blocking == BLOCKING) {
             printk(KERN_INFO "%s: Blocking operation, attempt to get lock.\n", MODNAME);
 
-            waiting_threads_high[minor]++;
-            ret = put_to_waitqueue(session->timeout, &the_flow->operation_synchronizer, wq);
-            waiting_threads_high[minor]--;
+            __sync_fetch_and_add(waiting_threads, 1);
+            ret = put_to_waitqueue(deadline, &the_flow->operation_synchronizer, wq);
+            __sync_fetch_and_add(waiting_threads, -1);
 
             // Sessione bloccante, ma lock non acquisito a timeout scaduto
             if (ret == 0) {
-                return LOCK_NOT_ACQUIRED;
+                return LOCK_TIMEOUT;
             }
         }
         // Sessione non bloccante e lock non acquisito
@@ -98,15 +237,820 @@ int get_lock(object_state *the_object, session_state *session, int minor, int lo
         }
     }
 
+    WRITE_ONCE(the_flow->lock_owner, current);
     printk(KERN_INFO "%s: Lock succesfully acquired.\n", MODNAME);
     return LOCK_ACQUIRED;
 }
 
+/**
+ * Riserva 'len' bytes dello spazio libero del dispositivo. Lo spazio è condiviso da tutti i flussi, che possono essere scritti
+ * in parallelo, quindi la riserva avviene in modo atomico. Ritorna 0 se lo spazio è stato riservato, NO_SPACE altrimenti.
+ */
+int reserve_space(object_state *the_object, size_t len) {
+    long available = atomic_long_read(&the_object->available_bytes);
+    long old;
+
+    while ((long)len <= available) {
+        old = atomic_long_cmpxchg(&the_object->available_bytes, available, available - len);
+        if (old == available) {
+            return 0;
+        }
+        available = old;
+    }
+    return NO_SPACE;
+}
+
+/**
+ * Restituisce al dispositivo 'len' bytes di spazio libero, riservati e non utilizzati oppure liberati da una lettura.
+ */
+void release_space(object_state *the_object, size_t len) {
+    atomic_long_add(len, &the_object->available_bytes);
+}
+
+/**
+ * Bytes scritti in un flusso sharded ma non ancora spostati nello stream: quelli accodati negli shard per-CPU e quelli nella lista pending.
+ * La somma avviene senza lock ed è solo indicativa, ma non sottostima mai i dati presenti.
+ */
+unsigned long flow_staged_bytes(flow_state *the_flow) {
+    int cpu;
+    unsigned long bytes;
+
+    if (the_flow->shards == NULL) {
+        return 0;
+    }
+    bytes = READ_ONCE(the_flow->pending_bytes);
+    for_each_possible_cpu(cpu) {
+        bytes += READ_ONCE(per_cpu_ptr(the_flow->shards, cpu)->bytes);
+    }
+    return bytes;
+}
+
+/**
+ * Bytes leggibili dal flusso, compresi quelli ancora negli shard che verranno spostati nello stream dal prossimo lettore.
+ */
+unsigned long flow_ready_bytes(flow_state *the_flow) {
+    return READ_ONCE(the_flow->ready_bytes) + flow_staged_bytes(the_flow);
+}
+
+/**
+ * Numero di sequenza dell'ultima scrittura sottomessa al flusso. Nei flussi sharded il contatore è condiviso dagli shard.
+ */
+u64 flow_submitted_seq(flow_state *the_flow) {
+    if (the_flow->shards != NULL) {
+        return atomic64_read(&the_flow->shard_seq);
+    }
+    return READ_ONCE(the_flow->submitted_seq);
+}
+
+/**
+ * Numero di sequenza dell'ultima scrittura completata nel flusso. Nei flussi sharded una scrittura è leggibile non appena viene
+ * accodata nello shard, quindi è completata al ritorno della relativa write.
+ */
+u64 flow_completed_seq(flow_state *the_flow) {
+    if (the_flow->shards != NULL) {
+        return atomic64_read(&the_flow->shard_seq);
+    }
+    return atomic64_read(&the_flow->completed_seq);
+}
+
+/**
+ * Bytes non ancora letti dal consumer group: quelli visibili nello stream dopo il cursore del gruppo e quelli ancora negli shard.
+ */
+unsigned long group_ready_bytes(flow_state *the_flow, consumer_group *group) {
+    return READ_ONCE(the_flow->tail_pos) - READ_ONCE(group->pos) + flow_staged_bytes(the_flow);
+}
+
+/**
+ * Bytes leggibili dalla sessione: nel solo flusso della sessione, oppure in tutti i flussi se la sessione legge in modalità READ_ANY.
+ * Una sessione in un consumer group legge solo il flusso del gruppo, a partire dal cursore del gruppo.
+ */
+unsigned long session_ready_bytes(object_state *the_object, session_state *session) {
+    int i;
+    unsigned long bytes = 0;
+    flow_state *the_flow;
+    if (session->group >= 0) {
+        the_flow = &the_object->priority_flow[session->group_flow];
+        return group_ready_bytes(the_flow, &the_flow->groups[session->group]);
+    }
+    if (session->read_mode == READ_SINGLE) {
+        return flow_ready_bytes(&the_object->priority_flow[session->priority]);
+    }
+    for (i = 0; i < the_object->num_flows; i++) {
+        bytes += flow_ready_bytes(&the_object->priority_flow[i]);
+    }
+    return bytes;
+}
+
+/**
+ * Verifica se sono presenti dati leggibili dalla sessione. La verifica avviene senza lock, quindi va ripetuta dopo averlo acquisito.
+ */
+int session_has_data(object_state *the_object, session_state *session) {
+    return session_ready_bytes(the_object, session) > 0;
+}
+
+/**
+ * Verifica se la sessione va risvegliata: sono in coda almeno rcvlowat bytes, oppure sono presenti dati ed è scaduto il max-delay.
+ * Senza low-watermark e max-delay è sufficiente la presenza di dati.
+ */
+int session_data_ready(object_state *the_object, session_state *session) {
+    unsigned long bytes = session_ready_bytes(the_object, session);
+    if (bytes == 0) {
+        return 0;
+    }
+    if (!READ_ONCE(session->relay_active)) {
+        return 1;
+    }
+    return bytes >= max(session->rcvlowat, 1UL) || test_bit(DELAY_EXPIRED, &session->delay_flags);
+}
+
+/**
+ * Aggiorna il numero di thread in attesa di dati sui flussi letti dalla sessione.
+ */
+void update_waiting_threads(object_state *the_object, session_state *session, int delta) {
+    int i;
+    if (session->read_mode == READ_SINGLE) {
+        __sync_fetch_and_add(&the_object->priority_flow[session->priority].waiting_threads, delta);
+        return;
+    }
+    for (i = 0; i < the_object->num_flows; i++) {
+        __sync_fetch_and_add(&the_object->priority_flow[i].waiting_threads, delta);
+    }
+}
+
+/**
+ * Risveglia i task in attesa di dati sul dispositivo. Va invocata dai writer dopo aver inserito nuovi dati in un flusso.
+ */
+void notify_data(object_state *the_object) {
+    wake_up(&the_object->data_queue);
+}
+
+/**
+ * Mette in attesa il task finché non sono presenti dati leggibili dalla sessione, fino alla scadenza assoluta 'deadline'.
+ * Deve essere invocata senza possedere il lock dei flussi. Il task viene risvegliato dalla notify_data dei writer, oppure, se la sessione
+ * ha un low-watermark o un max-delay, dal relay della sessione solo quando la soglia viene raggiunta.
+ * Ritorna 0 se sono presenti dati, LOCK_TIMEOUT se il timeout è scaduto, -ERESTARTSYS se il task riceve un segnale.
+ * Allo scadere del timeout i dati presenti sotto il low-watermark vengono comunque restituiti al lettore.
+ */
+int wait_for_data(object_state *the_object, session_state *session, ktime_t deadline) {
+    long val;
+    ktime_t left;
+    wait_queue_head_t *wq = READ_ONCE(session->relay_active) ? &session->poll_queue : &the_object->data_queue;
+    if (deadline == 0 || (left = time_left(deadline)) == 0) {
+        return session_has_data(the_object, session) ? 0 : LOCK_TIMEOUT;
+    }
+
+    printk(KERN_INFO "%s: Thread %d waiting data for %lld ns\n", MODNAME, current->pid, ktime_to_ns(left));
+
+    update_waiting_threads(the_object, session, 1);
+    val = wait_event_interruptible_hrtimeout(*wq, session_data_ready(the_object, session), left);
+    update_waiting_threads(the_object, session, -1);
+
+    if (val == -ETIME && session_has_data(the_object, session)) {
+        return 0;
+    }
+    if (val == -ETIME) {
+        printk("%s: Thread %d timeout elapsed. No data available\n", MODNAME, current->pid);
+        return LOCK_TIMEOUT;
+    }
+    return 0;
+}
+
 /**
  * Rilascia il mutex del flusso passato in input, e sveglia la relativa waitqueue.
  */
 void release_lock(flow_state *the_flow) {
+    WRITE_ONCE(the_flow->lock_owner, NULL);
     mutex_unlock(&(the_flow->operation_synchronizer));
     wake_up(&the_flow->wait_queue);
     printk(KERN_INFO "%s: Lock succesfully released.\n", MODNAME);
+}
+
+/**
+ * Lo spazio libero del dispositivo è condiviso tra i flussi: quando una lettura libera memoria si risvegliano
+ * le waitqueue di tutti i flussi, così che i writer in poll() su un flusso differente possano ripartire.
+ */
+void notify_space(object_state *the_object) {
+    int i;
+    for (i = 0; i < the_object->num_flows; i++) {
+        wake_up(&the_object->priority_flow[i].wait_queue);
+    }
+}
+
+/**
+ * Attende che la scrittura con numero di sequenza 'seq' sia stata resa visibile nello stream. Le scritture deferred vengono eseguite
+ * da una workqueue ordinata, quindi quando completed_seq raggiunge 'seq' sono visibili anche tutte le scritture precedenti.
+ * Come per le altre attese, se deadline è 0 non si attende: se la scrittura non è ancora completata si ritorna subito LOCK_TIMEOUT.
+ * Ritorna 0 a scrittura completata, LOCK_TIMEOUT o -ERESTARTSYS altrimenti.
+ */
+int wait_for_seq(flow_state *the_flow, u64 seq, ktime_t deadline) {
+    long val;
+
+    if (flow_completed_seq(the_flow) >= seq) {
+        return 0;
+    }
+    printk(KERN_INFO "%s: Thread %d waiting for write %llu to complete\n", MODNAME, current->pid, seq);
+
+    if (deadline == 0) {
+        return LOCK_TIMEOUT;
+    }
+    val = wait_event_interruptible_hrtimeout(the_flow->wait_queue, flow_completed_seq(the_flow) >= seq, time_left(deadline));
+    if (val == -ETIME) {
+        return LOCK_TIMEOUT;
+    }
+    return val;
+}
+
+/**
+ * Verifica se la coda delle scritture deferred del dispositivo ha raggiunto i limiti configurati. Una scrittura viene comunque
+ * accettata se la coda è vuota, così che scritture più grandi di max_deferred_bytes non vengano rifiutate indefinitamente.
+ */
+int deferred_queue_full(object_state *the_object, size_t len) {
+    unsigned long depth = atomic_long_read(&the_object->deferred_depth);
+    if (depth == 0) {
+        return 0;
+    }
+    if (max_deferred_items > 0 && depth + 1 > max_deferred_items) {
+        return 1;
+    }
+    if (max_deferred_bytes > 0 && atomic_long_read(&the_object->deferred_bytes) + len > max_deferred_bytes) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Verifica se una scrittura di 'len' bytes può essere salvata nel file di spill del flusso senza superare flow_spill_bytes.
+ * Oltre ai bytes già nel file si contano quelli riservati dalle scritture deferred destinate allo spill e non ancora eseguite.
+ * Lo spill non è disponibile per i flussi sharded, i cui writer non acquisiscono il lock del flusso. Va invocata possedendo il lock del flusso.
+ */
+int spill_room(flow_state *the_flow, int priority, size_t len) {
+    unsigned long max_spill = READ_ONCE(flow_spill_bytes[priority]);
+    return the_flow->shards == NULL && max_spill > 0 && the_flow->spill_bytes + the_flow->spill_pending + len <= max_spill;
+}
+
+/**
+ * Con la politica LAG_BLOCK verifica se una scrittura di 'len' bytes porterebbe un consumer group del flusso oltre group_max_lag.
+ * Il ritardo comprende le scritture deferred non ancora visibili. Un gruppo che ha già letto tutti i dati non blocca mai la scrittura,
+ * così che scritture più grandi di group_max_lag non vengano rifiutate indefinitamente.
+ */
+int group_lag_exceeded(flow_state *the_flow, size_t len) {
+    int i;
+    u64 end;
+    u64 pos;
+    unsigned long max_lag = READ_ONCE(group_max_lag);
+
+    if (READ_ONCE(group_lag_policy) != LAG_BLOCK || max_lag == 0) {
+        return 0;
+    }
+    end = READ_ONCE(the_flow->tail_pos) + READ_ONCE(the_flow->total_bytes) - READ_ONCE(the_flow->ready_bytes);
+    for (i = 0; i < MAX_GROUPS; i++) {
+        if (READ_ONCE(the_flow->groups[i].members) == 0) {
+            continue;
+        }
+        pos = READ_ONCE(the_flow->groups[i].pos);
+        if (end > pos && end - pos + len > max_lag) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Verifica se una scrittura di 'len' bytes sul flusso deve essere rallentata: per le classi deferred quando la coda delle scritture deferred
+ * è piena, per tutte le classi quando un consumer group supererebbe il ritardo massimo.
+ */
+int write_throttled(object_state *the_object, flow_state *the_flow, int priority, size_t len) {
+    return (flow_mode[priority] == DEFERRED_WRITE && deferred_queue_full(the_object, len)) || group_lag_exceeded(the_flow, len);
+}
+
+/**
+ * Mette in attesa il writer finché la scrittura di 'len' bytes non è più rallentata: la coda delle scritture deferred ha spazio ed i consumer group
+ * sono entro il ritardo massimo. Deve essere invocata senza possedere il lock del flusso: il writer viene risvegliato dalla release_lock
+ * della write_deferred o dei lettori. Ritorna 0 se la scrittura può procedere, LOCK_TIMEOUT se il timeout è scaduto, -ERESTARTSYS se il task riceve un segnale.
+ */
+int wait_for_write_slot(object_state *the_object, int priority, size_t len, ktime_t deadline) {
+    flow_state *the_flow = &the_object->priority_flow[priority];
+    long val;
+    ktime_t left;
+    if (deadline == 0 || (left = time_left(deadline)) == 0) {
+        return LOCK_TIMEOUT;
+    }
+
+    printk(KERN_INFO "%s: Thread %d waiting for a write slot for %lld ns\n", MODNAME, current->pid, ktime_to_ns(left));
+    val = wait_event_interruptible_hrtimeout(the_flow->wait_queue, !write_throttled(the_object, the_flow, priority, len), left);
+    if (val == -ERESTARTSYS) {
+        return val;
+    }
+    if (val == -ETIME) {
+        printk("%s: Thread %d timeout elapsed. Write still throttled\n", MODNAME, current->pid);
+        return LOCK_TIMEOUT;
+    }
+    return 0;
+}
+
+/**
+ * Verifica i limiti di frequenza di un token bucket per un'operazione di 'bytes' bytes all'istante 'now'. Se l'operazione è ammessa ritorna 0
+ * e, con 'charge', addebita al bucket i bytes ed un'operazione; altrimenti ritorna i nanosecondi di attesa prima che venga ammessa.
+ */
+u64 rate_take(rate_bucket *bucket, u64 rate_bytes, u64 rate_ops, size_t bytes, u64 now, int charge) {
+    u64 wait = 0;
+
+    spin_lock(&bucket->lock);
+    if (rate_bytes > 0 && bucket->bytes_tat > now + RATE_BURST_NS) {
+        wait = bucket->bytes_tat - now - RATE_BURST_NS;
+    }
+    if (rate_ops > 0 && bucket->ops_tat > now + RATE_BURST_NS) {
+        wait = max(wait, bucket->ops_tat - now - RATE_BURST_NS);
+    }
+    if (wait == 0 && charge) {
+        if (rate_bytes > 0) {
+            bucket->bytes_tat = max(bucket->bytes_tat, now) + mul_u64_u64_div_u64(bytes, NSEC_PER_SEC, rate_bytes);
+        }
+        if (rate_ops > 0) {
+            bucket->ops_tat = max(bucket->ops_tat, now) + div64_u64(NSEC_PER_SEC, rate_ops);
+        }
+    }
+    spin_unlock(&bucket->lock);
+    return wait;
+}
+
+/**
+ * Applica all'operazione di 'bytes' bytes i limiti di frequenza della sessione e quelli aggregati del dispositivo. L'operazione viene ammessa
+ * solo se rientra in entrambi i limiti, ed i due bucket vengono addebitati insieme. Deve essere invocata senza possedere alcun lock.
+ * Una sessione non bloccante riceve RATE_LIMITED, mentre una bloccante attende in sleep il tempo indicato dai bucket, fino alla scadenza.
+ * Ritorna 0 se l'operazione può procedere, RATE_LIMITED, LOCK_TIMEOUT se il timeout è scaduto, -ERESTARTSYS se il task riceve un segnale.
+ */
+int rate_limit(object_state *the_object, session_state *session, size_t bytes, int blocking, ktime_t deadline) {
+    int ret = 0;
+    u64 now;
+    u64 wait;
+    u64 start = 0;
+    ktime_t left;
+    u64 session_bytes = READ_ONCE(session->rate_bytes);
+    u64 session_ops = READ_ONCE(session->rate_ops);
+    u64 device_bytes = READ_ONCE(device_rate_bytes[session->minor]);
+    u64 device_ops = READ_ONCE(device_rate_ops[session->minor]);
+
+    // Le letture (bytes = 0) sono limitate solo nel numero di operazioni, ed un debito in bytes dei writer non le rallenta
+    if (bytes == 0) {
+        session_bytes = 0;
+        device_bytes = 0;
+    }
+    if (session_bytes == 0 && session_ops == 0 && device_bytes == 0 && device_ops == 0) {
+        return 0;
+    }
+
+    while (1) {
+        now = ktime_get_ns();
+        wait = max(rate_take(&session->rate, session_bytes, session_ops, bytes, now, 0), rate_take(&the_object->rate, device_bytes, device_ops, bytes, now, 0));
+        if (wait == 0) {
+            rate_take(&session->rate, session_bytes, session_ops, bytes, now, 1);
+            rate_take(&the_object->rate, device_bytes, device_ops, bytes, now, 1);
+            break;
+        }
+        if (start == 0) {
+            start = now;
+            atomic_long_inc(&session->rate.throttled);
+            atomic_long_inc(&the_object->rate.throttled);
+        }
+        if (blocking == NON_BLOCKING) {
+            ret = RATE_LIMITED;
+            break;
+        }
+        if (deadline == 0 || (left = time_left(deadline)) == 0) {
+            ret = LOCK_TIMEOUT;
+            break;
+        }
+
+        printk(KERN_INFO "%s: Thread %d throttled by rate limits for %llu ns\n", MODNAME, current->pid, wait);
+        left = ns_to_ktime(min_t(u64, wait, ktime_to_ns(left)));
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&left, HRTIMER_MODE_REL);
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+    }
+
+    if (start != 0) {
+        now = ktime_get_ns() - start;
+        atomic64_add(now, &session->rate.throttled_ns);
+        atomic64_add(now, &the_object->rate.throttled_ns);
+    }
+    return ret;
+}
+
+/**
+ * Costruisce l'ordine in cui una lettura READ_ANY serve le classi di priorità del dispositivo.
+ * - READ_STRICT: dalla classe più prioritaria alla meno prioritaria.
+ * - READ_WEIGHTED: la prima classe servita è scelta con uno smooth weighted round-robin tra le classi che hanno dati, in base a flow_weight.
+ *   Ad ogni lettura ciascuna classe con dati accumula il proprio peso, e quella con più crediti viene servita per prima pagando il peso totale.
+ *   Le classi restanti seguono in ordine di priorità, così da riempire il buffer utente.
+ */
+void build_read_order(object_state *the_object, session_state *session, int *order) {
+    int i, n;
+    int first = -1;
+    long total_weight = 0;
+
+    if (session->scheduler == READ_WEIGHTED) {
+        for (i = 0; i < the_object->num_flows; i++) {
+            if (flow_ready_bytes(&the_object->priority_flow[i]) == 0) {
+                continue;
+            }
+            session->sched_credit[i] += flow_weight[i];
+            total_weight += flow_weight[i];
+            if (first < 0 || session->sched_credit[i] > session->sched_credit[first]) {
+                first = i;
+            }
+        }
+        if (first >= 0) {
+            session->sched_credit[first] -= total_weight;
+        }
+    }
+
+    n = 0;
+    if (first >= 0) {
+        order[n++] = first;
+    }
+    for (i = the_object->num_flows - 1; i >= 0; i--) {
+        if (i != first) {
+            order[n++] = i;
+        }
+    }
+}
+
+/**
+ * Dealloca i dati contenuti nel blocco, sia che si trovino in un buffer contiguo che in pagine singole. Il blocco resta vuoto.
+ */
+void free_block_data(stream_block *block) {
+    unsigned int i;
+
+    if (block->pages != NULL) {
+        for (i = 0; i < block->nr_pages; i++) {
+            if (block->pages[i] != NULL) {
+                __free_page(block->pages[i]);
+            }
+        }
+        kvfree(block->pages);
+    }
+    kvfree(block->stream_content);
+    block->stream_content = NULL;
+    block->pages = NULL;
+    block->nr_pages = 0;
+    block->size = 0;
+    block->stored_size = 0;
+}
+
+/**
+ * Copia 'len' bytes dall'iteratore utente nel blocco. Le scritture di almeno large_write_threshold bytes vengono memorizzate in pagine singole,
+ * allocate e riempite una alla volta, così da non richiedere allocazioni contigue di ordine elevato; le altre in un unico buffer.
+ * Le allocazioni possono dormire: i chiamanti possiedono al più il mutex del flusso.
+ * Ritorna il numero di bytes copiati, ALLOC_ERROR se fallisce un'allocazione o COPY_ERROR se non è stato copiato alcun byte.
+ * In caso di errore il blocco resta vuoto.
+ */
+ssize_t fill_block(stream_block *block, struct iov_iter *from, size_t len) {
+    unsigned int i;
+    size_t chunk;
+    size_t ret;
+    size_t copied = 0;
+
+    if (large_write_threshold == 0 || len < large_write_threshold) {
+        block->stream_content = kzalloc(len + 1, GFP_KERNEL);
+        if (block->stream_content == NULL) {
+            return ALLOC_ERROR;
+        }
+        copied = copy_from_iter(block->stream_content, len, from);
+    } else {
+        block->nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+        block->pages = kvcalloc(block->nr_pages, sizeof(struct page *), GFP_KERNEL);
+        if (block->pages == NULL) {
+            block->nr_pages = 0;
+            return ALLOC_ERROR;
+        }
+        for (i = 0; i < block->nr_pages && copied < len; i++) {
+            block->pages[i] = alloc_page(GFP_KERNEL);
+            if (block->pages[i] == NULL) {
+                free_block_data(block);
+                return ALLOC_ERROR;
+            }
+            chunk = min_t(size_t, PAGE_SIZE, len - copied);
+            ret = copy_page_from_iter(block->pages[i], 0, chunk, from);
+            copied += ret;
+            if (ret < chunk) {
+                break;
+            }
+        }
+    }
+
+    block->size = copied;
+    if (copied == 0 && len > 0) {
+        free_block_data(block);
+        return COPY_ERROR;
+    }
+    return copied;
+}
+
+/**
+ * Comprime con LZ4 i dati di un blocco in buffer contiguo, se la compressione delle scritture deferred è abilitata e riduce la dimensione dei dati.
+ * Viene invocata dalla write_deferred prima di acquisire il lock del flusso: la workqueue ordinata del dispositivo esegue una scrittura alla volta,
+ * quindi la memoria di lavoro del dispositivo non viene mai condivisa. Ritorna i bytes risparmiati, 0 se il blocco resta non compresso.
+ */
+size_t compress_block(object_state *the_object, stream_block *block) {
+#ifdef HAVE_LZ4
+    int stored;
+    char *scratch;
+    char *compressed;
+
+    if (!READ_ONCE(deferred_compress) || block->stream_content == NULL || block->size < max(READ_ONCE(deferred_compress_min), 2UL)) {
+        return 0;
+    }
+    if (the_object->lz4_wrkmem == NULL) {
+        the_object->lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (the_object->lz4_wrkmem == NULL) {
+            return 0;
+        }
+    }
+    scratch = kvmalloc(block->size, GFP_KERNEL);
+    if (scratch == NULL) {
+        return 0;
+    }
+
+    // Con un limite di output inferiore alla dimensione dei dati la compressione fallisce se non porta alcun risparmio
+    stored = LZ4_compress_default(block->stream_content, scratch, block->size, block->size - 1, the_object->lz4_wrkmem);
+    compressed = stored > 0 ? kmemdup(scratch, stored, GFP_KERNEL) : NULL;
+    kvfree(scratch);
+    if (compressed == NULL) {
+        return 0;
+    }
+
+    kvfree(block->stream_content);
+    block->stream_content = compressed;
+    block->stored_size = stored;
+    WRITE_ONCE(the_object->compress_in, the_object->compress_in + block->size);
+    WRITE_ONCE(the_object->compress_out, the_object->compress_out + stored);
+    return block->size - stored;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Decomprime i dati di un blocco compresso dalla compress_block, alla prima lettura da parte di uno dei cursori del flusso.
+ * I bytes risparmiati dalla compressione tornano ad occupare spazio sul dispositivo anche se lo spazio libero non è sufficiente,
+ * così che una lettura non fallisca mai per mancanza di spazio. Va invocata possedendo il lock del flusso.
+ * Ritorna 0, ALLOC_ERROR se non è possibile allocare il buffer dei dati decompressi, oppure DECOMPRESS_ERROR se i dati non sono validi
+ * o se il modulo è stato compilato senza LZ4: il buffer di un blocco compresso non contiene 'size' bytes, e non va mai letto come tale.
+ */
+int inflate_block(object_state *the_object, stream_block *block) {
+#ifdef HAVE_LZ4
+    char *content;
+#endif
+
+    if (block->stored_size == 0) {
+        return 0;
+    }
+#ifdef HAVE_LZ4
+    content = kzalloc(block->size + 1, GFP_KERNEL);
+    if (content == NULL) {
+        return ALLOC_ERROR;
+    }
+    if (WARN_ON_ONCE(LZ4_decompress_safe(block->stream_content, content, block->stored_size, block->size) != (int)block->size)) {
+        kfree(content);
+        return DECOMPRESS_ERROR;
+    }
+
+    atomic_long_sub(block->size - block->stored_size, &the_object->available_bytes);
+    kvfree(block->stream_content);
+    block->stream_content = content;
+    block->stored_size = 0;
+    return 0;
+#else
+    return DECOMPRESS_ERROR;
+#endif
+}
+
+#ifdef HAVE_LZ4
+/**
+ * Verifica che 'stored' bytes compressi si decomprimano esattamente in 'size' bytes, senza conservare i dati decompressi.
+ * Viene usata per i blocchi ricaricati dal checkpoint, che non vanno pubblicati se la loro prima lettura fallirebbe.
+ * Ritorna 0, ALLOC_ERROR oppure DECOMPRESS_ERROR.
+ */
+int compressed_valid(const char *src, size_t stored, size_t size) {
+    char *content = kvmalloc(size, GFP_KERNEL);
+    int valid;
+
+    if (content == NULL) {
+        return ALLOC_ERROR;
+    }
+    valid = LZ4_decompress_safe(src, content, stored, size) == (int)size;
+    kvfree(content);
+    return valid ? 0 : DECOMPRESS_ERROR;
+}
+#endif
+
+/**
+ * Bytes con cui sono memorizzati i dati del blocco, in memoria o nel file di spill: quelli compressi per un blocco compresso.
+ */
+size_t block_data_bytes(stream_block *block) {
+    return block->stored_size > 0 ? block->stored_size : block->size;
+}
+
+/**
+ * Bytes di memoria occupati dai dati del blocco e addebitati allo spazio libero del dispositivo, nessuno per un blocco nel file di spill.
+ */
+size_t block_charge(stream_block *block) {
+    return block->spilled ? 0 : block_data_bytes(block);
+}
+
+/**
+ * Rilascia la regione [start,end) del file di spill, i cui dati sono stati riletti o scartati. Quando nel file non restano dati
+ * le scritture successive ripartono dall'inizio del file. Va invocata possedendo il lock del flusso.
+ */
+void spill_discard(flow_state *the_flow, loff_t start, loff_t end) {
+    vfs_fallocate(the_flow->spill_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+    if (the_flow->spill_bytes == 0) {
+        the_flow->spill_tail = 0;
+    }
+}
+
+/**
+ * Salva i dati del blocco nel file di spill del flusso, creandolo al primo utilizzo, e libera la memoria che li conteneva.
+ * I blocchi vengono salvati in sequenza, quindi scritture consecutive occupano regioni contigue del file. Va invocata possedendo il lock del flusso.
+ * Ritorna 0, oppure un errno negativo se il file non può essere creato o scritto: in questo caso il blocco resta in memoria.
+ */
+int spill_block(flow_state *the_flow, stream_block *block) {
+    unsigned int i;
+    ssize_t ret;
+    size_t len;
+    size_t size;
+    size_t stored;
+    loff_t pos;
+    struct file *file;
+
+    if (the_flow->spill_file == NULL) {
+        file = shmem_file_setup("mflow-spill", 0, VM_NORESERVE);
+        if (IS_ERR(file)) {
+            return PTR_ERR(file);
+        }
+        the_flow->spill_file = file;
+    }
+
+    // Le pagine di una scrittura grande sono allocate con GFP_KERNEL, quindi sempre mappate nello spazio di indirizzamento del kernel
+    pos = the_flow->spill_tail;
+    if (block->pages == NULL) {
+        len = block_charge(block);
+        ret = kernel_write(the_flow->spill_file, block->stream_content, len, &pos);
+    } else {
+        for (i = 0, ret = 0, len = 0; (size_t)i * PAGE_SIZE < block->size && ret == (ssize_t)len; i++) {
+            len = min_t(size_t, PAGE_SIZE, block->size - (size_t)i * PAGE_SIZE);
+            ret = kernel_write(the_flow->spill_file, page_address(block->pages[i]), len, &pos);
+        }
+    }
+    if (ret != (ssize_t)len) {
+        return ret < 0 ? ret : SPILL_ERROR;
+    }
+
+    size = block->size;
+    stored = block->stored_size;
+    free_block_data(block);
+    block->size = size;
+    block->stored_size = stored;
+    block->spilled = 1;
+    block->spill_pos = the_flow->spill_tail;
+    the_flow->spill_tail = pos;
+    WRITE_ONCE(the_flow->spill_bytes, the_flow->spill_bytes + size);
+    return 0;
+}
+
+/**
+ * Riporta in memoria i dati di un blocco salvato nel file di spill, insieme a quelli dei blocchi successivi contigui nel file, fino a
+ * spill_read_chunk bytes: la lettura del file procede in sequenza, a blocchi grandi. Come per la decompressione, i dati riletti vengono
+ * addebitati allo spazio del dispositivo anche se lo spazio libero non è sufficiente. Va invocata possedendo il lock del flusso.
+ * Ritorna 0 se almeno il primo blocco è stato riletto, altrimenti ALLOC_ERROR o SPILL_ERROR.
+ */
+int load_spilled(object_state *the_object, flow_state *the_flow, stream_block *block) {
+    int ret = 0;
+    size_t len;
+    size_t loaded = 0;
+    char *content;
+    loff_t pos;
+    loff_t start = block->spill_pos;
+    loff_t end = start;
+
+    do {
+        len = block_data_bytes(block);
+        content = kvmalloc(len + 1, GFP_KERNEL);
+        if (content == NULL) {
+            ret = ALLOC_ERROR;
+            break;
+        }
+        pos = block->spill_pos;
+        if (kernel_read(the_flow->spill_file, content, len, &pos) != (ssize_t)len) {
+            kvfree(content);
+            ret = SPILL_ERROR;
+            break;
+        }
+        content[len] = '\0';
+        block->stream_content = content;
+        block->spilled = 0;
+        atomic_long_sub(len, &the_object->available_bytes);
+        WRITE_ONCE(the_flow->spill_bytes, the_flow->spill_bytes - block->size);
+        loaded += len;
+        end = pos;
+        block = block->next;
+    } while (loaded < READ_ONCE(spill_read_chunk) && block != NULL && block->spilled && block->spill_pos == end);
+
+    if (end > start) {
+        spill_discard(the_flow, start, end);
+    }
+    return loaded > 0 ? 0 : ret;
+}
+
+/**
+ * Copia nell'iteratore utente al massimo 'len' bytes del blocco, a partire da 'offset'. Un blocco nel file di spill viene prima riletto,
+ * ed un blocco compresso decompresso: se non è possibile non viene copiato alcun byte, ed il blocco resta nello stream.
+ * Va invocata possedendo il lock del flusso. Ritorna il numero di bytes copiati.
+ */
+size_t block_copy_to_iter(object_state *the_object, flow_state *the_flow, stream_block *block, size_t offset, size_t len, struct iov_iter *to) {
+    size_t chunk;
+    size_t ret;
+    size_t copied = 0;
+
+    if (block->spilled && load_spilled(the_object, the_flow, block) < 0) {
+        return 0;
+    }
+    if (inflate_block(the_object, block) < 0) {
+        return 0;
+    }
+    if (block->pages == NULL) {
+        return copy_to_iter(block->stream_content + offset, len, to);
+    }
+    while (copied < len) {
+        chunk = min_t(size_t, PAGE_SIZE - offset_in_page(offset), len - copied);
+        ret = copy_page_to_iter(block->pages[offset >> PAGE_SHIFT], offset_in_page(offset), chunk, to);
+        copied += ret;
+        offset += ret;
+        if (ret < chunk) {
+            break;
+        }
+    }
+    return copied;
+}
+
+/**
+ * Sposta i dati dal blocco 'src' al blocco vuoto 'dst', senza copiarli. Il blocco 'src' resta vuoto.
+ */
+void move_block_data(stream_block *dst, stream_block *src) {
+    dst->stream_content = src->stream_content;
+    dst->pages = src->pages;
+    dst->nr_pages = src->nr_pages;
+    dst->size = src->size;
+    dst->stored_size = src->stored_size;
+    dst->spilled = src->spilled;
+    dst->spill_pos = src->spill_pos;
+    dst->seq = src->seq;
+    dst->enqueue_ns = src->enqueue_ns;
+    dst->visible_ns = src->visible_ns;
+    src->stream_content = NULL;
+    src->pages = NULL;
+    src->nr_pages = 0;
+    src->size = 0;
+    src->stored_size = 0;
+    src->spilled = 0;
+    src->enqueue_ns = 0;
+    src->visible_ns = 0;
+}
+
+/**
+ * Registra nell'istogramma logaritmico la latenza tra gli istanti 'from' e 'to', in nanosecondi. Va invocata possedendo il lock del flusso.
+ */
+void record_latency(unsigned long *hist, u64 from, u64 to) {
+    int bucket = min_t(int, fls64(to > from ? to - from : 0), LAT_BUCKETS - 1);
+    WRITE_ONCE(hist[bucket], hist[bucket] + 1);
+}
+
+/**
+ * Rende visibile nello stream il blocco in coda al flusso, appena riempito, assegnandogli la posizione assoluta dei suoi dati.
+ * Se il blocco non ha già un istante di visibilità (assegnato dalla write_on_shard) si usa l'istante corrente, e si registra la latenza submit→visible.
+ * Va invocata possedendo il lock del flusso.
+ */
+void publish_block(flow_state *the_flow, stream_block *block) {
+    if (block->visible_ns == 0) {
+        block->visible_ns = ktime_get_ns();
+    }
+    record_latency(the_flow->visible_hist, block->enqueue_ns, block->visible_ns);
+    block->start = the_flow->tail_pos;
+    WRITE_ONCE(the_flow->tail_pos, the_flow->tail_pos + block->size);
+}
+
+/**
+ * Salva nella sessione gli istanti del primo messaggio letto a partire dal cursore (block, offset). Se il cursore è alla fine del blocco
+ * il primo messaggio letto è quello del blocco successivo. Va invocata possedendo il lock del flusso.
+ */
+void stamp_read(session_state *session, stream_block *block, size_t offset) {
+    if (offset >= block->size && block->next != NULL) {
+        block = block->next;
+    }
+    session->read_enqueue_ns = block->enqueue_ns;
+    session->read_visible_ns = block->visible_ns;
 }
\ No newline at end of file
@@ -0,0 +1,380 @@
+/*
+=====================================================================================================
+                                            libmflow.c
+-----------------------------------------------------------------------------------------------------
+Implementazione della libreria client del multiflow-driver.
+=====================================================================================================
+*/
+
+#include "libmflow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Istante corrente in nanosecondi di CLOCK_MONOTONIC, lo stesso orologio usato dal driver
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Esegue una ioctl sulla sessione, convertendo l'errore in -errno
+ */
+static int session_ioctl(mflow_session *session, unsigned long command, void *arg) {
+    return ioctl(session->fd, command, arg) < 0 ? -errno : 0;
+}
+
+// ------------------------------------------------ SESSIONE ------------------------------------------------
+/**
+ * Apre una sessione sul dispositivo 'minor'. Con 'path' a NULL si usano i nodi creati dal driver (MFLOW_DEFAULT_PATH).
+ * I flag vengono aggiunti ad O_RDWR: con O_NONBLOCK le operazioni della sessione non sono mai bloccanti.
+ */
+int mflow_open(mflow_session *session, const char *path, int minor, int flags) {
+    char node[64];
+
+    snprintf(node, sizeof(node), "%s%d", path != NULL ? path : MFLOW_DEFAULT_PATH, minor);
+    session->fd = open(node, O_RDWR | flags);
+    session->minor = minor;
+    session->user = NULL;
+    return session->fd < 0 ? -errno : 0;
+}
+
+/**
+ * Chiude la sessione
+ */
+int mflow_close(mflow_session *session) {
+    int ret = 0;
+
+    if (session->fd >= 0 && close(session->fd) < 0) {
+        ret = -errno;
+    }
+    session->fd = -1;
+    return ret;
+}
+
+/**
+ * Applica in una sola chiamata i parametri della sessione selezionati da params->mask. La versione dell'ABI viene impostata dalla libreria.
+ */
+int mflow_configure(mflow_session *session, const struct mflow_session_params *params) {
+    struct mflow_session_params copy = *params;
+
+    copy.version = MFLOW_ABI_VERSION;
+    return session_ioctl(session, MFLOW_IOC_SET_SESSION_PARAMS, &copy);
+}
+
+/**
+ * Legge tutti i parametri correnti della sessione
+ */
+int mflow_get_params(mflow_session *session, struct mflow_session_params *params) {
+    return session_ioctl(session, MFLOW_IOC_GET_SESSION_PARAMS, params);
+}
+
+/**
+ * Imposta i limiti di frequenza della sessione [0 = nessun limite]
+ */
+int mflow_set_rate_limit(mflow_session *session, uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+    struct mflow_rate_limit limit = {.bytes_per_sec = bytes_per_sec, .ops_per_sec = ops_per_sec};
+    return session_ioctl(session, MFLOW_IOC_SET_RATE_LIMIT, &limit);
+}
+
+/**
+ * Legge i limiti di frequenza della sessione ed i contatori delle operazioni rallentate
+ */
+int mflow_get_rate_limit(mflow_session *session, struct mflow_rate_limit *limit) {
+    return session_ioctl(session, MFLOW_IOC_GET_RATE_LIMIT, limit);
+}
+
+/**
+ * Inserisce la sessione nel consumer group 'name' del proprio flusso
+ */
+int mflow_join_group(mflow_session *session, const char *name) {
+    char group[MFLOW_GROUP_NAME_LEN] = {0};
+
+    if (strlen(name) >= MFLOW_GROUP_NAME_LEN) {
+        return -EINVAL;
+    }
+    strcpy(group, name);
+    return session_ioctl(session, MFLOW_IOC_JOIN_GROUP, group);
+}
+
+/**
+ * Rimuove la sessione dal proprio consumer group
+ */
+int mflow_leave_group(mflow_session *session) {
+    return session_ioctl(session, MFLOW_IOC_LEAVE_GROUP, NULL);
+}
+
+/**
+ * Attende che tutte le scritture della sessione siano visibili nello stream, al massimo fino al timeout o alla scadenza della sessione
+ */
+int mflow_flush(mflow_session *session) {
+    return session_ioctl(session, MFLOW_IOC_FLUSH_SESSION, NULL);
+}
+
+/**
+ * Istanti di sottomissione e di visibilità del primo messaggio dell'ultima lettura della sessione
+ */
+int mflow_get_read_times(mflow_session *session, struct mflow_read_times *times) {
+    return session_ioctl(session, MFLOW_IOC_GET_READ_TIMES, times);
+}
+
+// ------------------------------------------------- WRITER -------------------------------------------------
+/**
+ * Inizializza il writer della sessione. Con 'buf' a NULL viene allocato un buffer di 'cap' bytes (MFLOW_WRITER_BUFFER se 'cap' è 0).
+ * 'max_delay_ns' è l'attesa massima di un messaggio nel buffer, verificata ad ogni mflow_writer_append e mflow_writer_tick.
+ */
+int mflow_writer_init(mflow_writer *writer, mflow_session *session, void *buf, size_t cap, uint64_t max_delay_ns) {
+    memset(writer, 0, sizeof(*writer));
+    writer->session = session;
+    writer->cap = cap > 0 ? cap : MFLOW_WRITER_BUFFER;
+    writer->max_delay_ns = max_delay_ns;
+    writer->buf = buf;
+    if (writer->buf == NULL) {
+        writer->buf = malloc(writer->cap);
+        if (writer->buf == NULL) {
+            return -ENOMEM;
+        }
+        writer->owns_buf = 1;
+    }
+    return 0;
+}
+
+/**
+ * Rilascia il buffer del writer, se allocato dalla libreria. I messaggi ancora in attesa vanno inviati prima con mflow_writer_flush.
+ */
+void mflow_writer_destroy(mflow_writer *writer) {
+    if (writer->owns_buf) {
+        free(writer->buf);
+    }
+    writer->buf = NULL;
+    writer->len = 0;
+}
+
+/**
+ * Invia in una sola scrittura vettoriale i messaggi in attesa nel buffer, seguiti da 'msg' se non è NULL.
+ * Il driver accetta una scrittura per intero oppure la rifiuta: se il dispositivo è pieno, o la sessione non bloccante non ottiene il lock,
+ * i messaggi restano nel buffer e viene ritornato l'errore. Una scrittura parziale avviene solo se il driver non riesce a copiare
+ * i dati, e viene ritornata come -EIO dopo aver scartato i bytes già scritti.
+ */
+static int writer_send(mflow_writer *writer, const void *msg, size_t len) {
+    struct iovec iov[2];
+    int count = 0;
+    size_t total = writer->len + len;
+    ssize_t ret;
+
+    if (writer->len > 0) {
+        iov[count].iov_base = writer->buf;
+        iov[count++].iov_len = writer->len;
+    }
+    if (msg != NULL && len > 0) {
+        iov[count].iov_base = (void *)msg;
+        iov[count++].iov_len = len;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    ret = writev(writer->session->fd, iov, count);
+    if (ret < 0) {
+        return -errno;
+    }
+    writer->writes++;
+    if ((size_t)ret < writer->len) {
+        memmove(writer->buf, writer->buf + ret, writer->len - ret);
+        writer->len -= ret;
+        return -EIO;
+    }
+    writer->len = 0;
+    return (size_t)ret < total ? -EIO : 0;
+}
+
+/**
+ * Accoda un messaggio al writer. Un messaggio più grande di metà buffer non viene copiato, ma inviato subito insieme ai messaggi in attesa;
+ * se il messaggio non entra nello spazio libero del buffer, i messaggi in attesa vengono prima inviati. Ritorna 0 se il messaggio è stato
+ * accodato o scritto, altrimenti l'errore della scrittura (ad esempio -EAGAIN o -ENOSPC) ed il messaggio non viene accodato.
+ */
+int mflow_writer_append(mflow_writer *writer, const void *msg, size_t len) {
+    int ret;
+
+    if (len > writer->cap / 2) {
+        ret = writer_send(writer, msg, len);
+        if (ret == 0) {
+            writer->messages++;
+        }
+        return ret;
+    }
+    if (len > writer->cap - writer->len) {
+        ret = writer_send(writer, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (writer->len == 0) {
+        writer->first_ns = now_ns();
+    }
+    memcpy(writer->buf + writer->len, msg, len);
+    writer->len += len;
+    writer->messages++;
+    return mflow_writer_tick(writer);
+}
+
+/**
+ * Invia subito i messaggi in attesa nel buffer
+ */
+int mflow_writer_flush(mflow_writer *writer) {
+    return writer_send(writer, NULL, 0);
+}
+
+/**
+ * Invia i messaggi in attesa se il primo ha superato il max-delay del writer. Va invocata periodicamente dal loop dell'applicazione,
+ * ad esempio al ritorno della mflow_poller_wait. Un errore della scrittura lascia i messaggi nel buffer.
+ */
+int mflow_writer_tick(mflow_writer *writer) {
+    if (writer->len == 0 || writer->max_delay_ns == 0 || now_ns() - writer->first_ns < writer->max_delay_ns) {
+        return 0;
+    }
+    return writer_send(writer, NULL, 0);
+}
+
+/**
+ * Millisecondi che mancano alla scadenza del max-delay dei messaggi in attesa, da usare come timeout della mflow_poller_wait.
+ * Ritorna -1 se non ci sono messaggi in attesa o non c'è un max-delay.
+ */
+int mflow_writer_timeout_ms(const mflow_writer *writer) {
+    uint64_t elapsed;
+    uint64_t left;
+
+    if (writer->len == 0 || writer->max_delay_ns == 0) {
+        return -1;
+    }
+    elapsed = now_ns() - writer->first_ns;
+    if (elapsed >= writer->max_delay_ns) {
+        return 0;
+    }
+    left = (writer->max_delay_ns - elapsed + 999999) / 1000000;
+    return left > 0x7fffffff ? 0x7fffffff : (int)left;
+}
+
+// ------------------------------------------------- READER -------------------------------------------------
+/**
+ * Inizializza il reader della sessione. Con 'buf' a NULL viene allocato un buffer di 'cap' bytes (MFLOW_READER_BUFFER se 'cap' è 0).
+ */
+int mflow_reader_init(mflow_reader *reader, mflow_session *session, void *buf, size_t cap) {
+    memset(reader, 0, sizeof(*reader));
+    reader->session = session;
+    reader->cap = cap > 0 ? cap : MFLOW_READER_BUFFER;
+    reader->buf = buf;
+    if (reader->buf == NULL) {
+        reader->buf = malloc(reader->cap);
+        if (reader->buf == NULL) {
+            return -ENOMEM;
+        }
+        reader->owns_buf = 1;
+    }
+    return 0;
+}
+
+/**
+ * Rilascia il buffer del reader, se allocato dalla libreria
+ */
+void mflow_reader_destroy(mflow_reader *reader) {
+    if (reader->owns_buf) {
+        free(reader->buf);
+    }
+    reader->buf = NULL;
+}
+
+/**
+ * Legge dalla sessione al massimo un buffer di dati. '*data' punta ai dati letti nel buffer del reader, validi fino alla lettura successiva.
+ * Ritorna il numero di bytes letti, oppure -errno (-EAGAIN se non ci sono dati in una sessione non bloccante).
+ */
+ssize_t mflow_reader_next(mflow_reader *reader, const void **data) {
+    ssize_t ret = read(reader->session->fd, reader->buf, reader->cap);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    *data = reader->buf;
+    return ret;
+}
+
+// ------------------------------------------------- POLLER -------------------------------------------------
+/**
+ * Crea l'istanza epoll del poller
+ */
+int mflow_poller_init(mflow_poller *poller) {
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return poller->epfd < 0 ? -errno : 0;
+}
+
+/**
+ * Chiude l'istanza epoll del poller. Le sessioni non vengono chiuse.
+ */
+int mflow_poller_close(mflow_poller *poller) {
+    int ret = close(poller->epfd) < 0 ? -errno : 0;
+    poller->epfd = -1;
+    return ret;
+}
+
+/**
+ * Registra o modifica gli eventi di interesse di una sessione
+ */
+static int poller_ctl(mflow_poller *poller, int op, mflow_session *session, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = session};
+    return epoll_ctl(poller->epfd, op, session->fd, &ev) < 0 ? -errno : 0;
+}
+
+/**
+ * Aggiunge una sessione al poller, con gli eventi di interesse (EPOLLIN, EPOLLOUT, EPOLLPRI, eventualmente EPOLLET)
+ */
+int mflow_poller_add(mflow_poller *poller, mflow_session *session, uint32_t events) {
+    return poller_ctl(poller, EPOLL_CTL_ADD, session, events);
+}
+
+/**
+ * Modifica gli eventi di interesse di una sessione già registrata, ad esempio per attendere EPOLLOUT solo dopo un -EAGAIN
+ */
+int mflow_poller_modify(mflow_poller *poller, mflow_session *session, uint32_t events) {
+    return poller_ctl(poller, EPOLL_CTL_MOD, session, events);
+}
+
+/**
+ * Rimuove una sessione dal poller
+ */
+int mflow_poller_remove(mflow_poller *poller, mflow_session *session) {
+    return poller_ctl(poller, EPOLL_CTL_DEL, session, 0);
+}
+
+/**
+ * Attende al massimo 'timeout_ms' millisecondi (-1 = senza limite) che almeno una sessione sia pronta, e ne copia al massimo
+ * 'max_events' in 'events'. Ritorna il numero di sessioni pronte, oppure -errno.
+ */
+int mflow_poller_wait(mflow_poller *poller, mflow_event *events, int max_events, int timeout_ms) {
+    struct epoll_event ready[MFLOW_POLL_BATCH];
+    int i;
+    int ret;
+
+    if (max_events <= 0) {
+        return -EINVAL;
+    }
+    ret = epoll_wait(poller->epfd, ready, max_events < MFLOW_POLL_BATCH ? max_events : MFLOW_POLL_BATCH, timeout_ms);
+    if (ret < 0) {
+        return -errno;
+    }
+    for (i = 0; i < ret; i++) {
+        events[i].session = ready[i].data.ptr;
+        events[i].events = ready[i].events;
+    }
+    return ret;
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+/*
+=====================================================================================================
+                                            libmflow.h
+-----------------------------------------------------------------------------------------------------
+Libreria client del multiflow-driver. Offre una sessione verso un dispositivo, la configurazione della
+sessione in una sola chiamata, un writer che raccoglie i messaggi piccoli in scritture vettoriali,
+un reader che riutilizza sempre lo stesso buffer, ed un poller epoll su più dispositivi.
+Le funzioni ritornano 0 (o il numero di bytes) in caso di successo, -errno in caso di errore.
+Nessuna funzione alloca memoria, tranne le init a cui non viene passato un buffer.
+=====================================================================================================
+*/
+
+#ifndef LIBMFLOW_H
+#define LIBMFLOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+// Header dell'ABI del driver (driver/utils/mflow_ioctl.h), da installare accanto a libmflow.h oppure da rendere visibile con -I
+#include <mflow_ioctl.h>
+
+#define MFLOW_DEFAULT_PATH "/dev/mflow-dev"  // Prefisso dei nodi creati dal driver, a cui segue il minor
+#define MFLOW_WRITER_BUFFER 65536            // Dimensione di default del buffer del writer
+#define MFLOW_READER_BUFFER 65536            // Dimensione di default del buffer del reader
+#define MFLOW_POLL_BATCH 64                  // Eventi massimi restituiti da una singola mflow_poller_wait
+
+/**
+ * Sessione aperta verso un dispositivo. La struttura viene allocata dal chiamante.
+ */
+typedef struct mflow_session {
+    int fd;      // File descriptor della sessione, -1 se chiusa
+    int minor;   // Minor number del dispositivo
+    void *user;  // Dato del chiamante, restituito insieme agli eventi del poller
+} mflow_session;
+
+/**
+ * Writer bufferizzato di una sessione. I messaggi vengono copiati nel buffer ed inviati al driver con una sola scrittura quando il buffer
+ * è pieno, quando scade il max-delay del primo messaggio in attesa, oppure con mflow_writer_flush. Un messaggio più grande di metà buffer
+ * viene inviato senza essere copiato, nella stessa scrittura vettoriale dei messaggi già in attesa.
+ * Il driver non conserva i confini dei messaggi: una scrittura del writer diventa un unico blocco dello stream.
+ */
+typedef struct mflow_writer {
+    mflow_session *session;  // Sessione su cui vengono scritti i messaggi
+    char *buf;               // Buffer dei messaggi in attesa
+    size_t cap;              // Dimensione del buffer
+    size_t len;              // Bytes in attesa nel buffer
+    uint64_t max_delay_ns;   // Attesa massima del primo messaggio nel buffer prima dell'invio [0 = nessun limite]
+    uint64_t first_ns;       // Istante (CLOCK_MONOTONIC) in cui il primo messaggio in attesa è stato accodato
+    int owns_buf;            // Il buffer è stato allocato dalla mflow_writer_init
+    uint64_t messages;       // Messaggi accodati
+    uint64_t writes;         // Scritture effettuate sul dispositivo
+} mflow_writer;
+
+/**
+ * Reader di una sessione. Ogni lettura riempie lo stesso buffer, senza allocazioni.
+ */
+typedef struct mflow_reader {
+    mflow_session *session;  // Sessione da cui vengono letti i dati
+    char *buf;               // Buffer delle letture
+    size_t cap;              // Dimensione del buffer
+    int owns_buf;            // Il buffer è stato allocato dalla mflow_reader_init
+} mflow_reader;
+
+/**
+ * Poller epoll di più sessioni, anche su dispositivi diversi. Le sessioni dovrebbero essere aperte non bloccanti.
+ */
+typedef struct mflow_poller {
+    int epfd;  // File descriptor dell'istanza epoll
+} mflow_poller;
+
+/**
+ * Evento restituito dalla mflow_poller_wait
+ */
+typedef struct mflow_event {
+    mflow_session *session;  // Sessione pronta
+    uint32_t events;         // EPOLLIN (dati da leggere), EPOLLOUT (spazio libero), EPOLLPRI (scritture della sessione completate)
+} mflow_event;
+
+// Sessione
+int mflow_open(mflow_session *session, const char *path, int minor, int flags);
+int mflow_close(mflow_session *session);
+int mflow_configure(mflow_session *session, const struct mflow_session_params *params);
+int mflow_get_params(mflow_session *session, struct mflow_session_params *params);
+int mflow_set_rate_limit(mflow_session *session, uint64_t bytes_per_sec, uint64_t ops_per_sec);
+int mflow_get_rate_limit(mflow_session *session, struct mflow_rate_limit *limit);
+int mflow_join_group(mflow_session *session, const char *name);
+int mflow_leave_group(mflow_session *session);
+int mflow_flush(mflow_session *session);
+int mflow_get_read_times(mflow_session *session, struct mflow_read_times *times);
+
+// Writer bufferizzato
+int mflow_writer_init(mflow_writer *writer, mflow_session *session, void *buf, size_t cap, uint64_t max_delay_ns);
+void mflow_writer_destroy(mflow_writer *writer);
+int mflow_writer_append(mflow_writer *writer, const void *msg, size_t len);
+int mflow_writer_flush(mflow_writer *writer);
+int mflow_writer_tick(mflow_writer *writer);
+int mflow_writer_timeout_ms(const mflow_writer *writer);
+
+// Reader
+int mflow_reader_init(mflow_reader *reader, mflow_session *session, void *buf, size_t cap);
+void mflow_reader_destroy(mflow_reader *reader);
+ssize_t mflow_reader_next(mflow_reader *reader, const void **data);
+
+// Poller
+int mflow_poller_init(mflow_poller *poller);
+int mflow_poller_close(mflow_poller *poller);
+int mflow_poller_add(mflow_poller *poller, mflow_session *session, uint32_t events);
+int mflow_poller_modify(mflow_poller *poller, mflow_session *session, uint32_t events);
+int mflow_poller_remove(mflow_poller *poller, mflow_session *session);
+int mflow_poller_wait(mflow_poller *poller, mflow_event *events, int max_events, int timeout_ms);
+
+#endif
\ No newline at end of file
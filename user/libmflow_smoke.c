@@ -0,0 +1,181 @@
+/*
+=====================================================================================================
+                                         libmflow_smoke.c
+-----------------------------------------------------------------------------------------------------
+Prova minima della libreria libmflow: una sessione scrive tramite il writer bufferizzato una serie
+di messaggi piccoli ed uno più grande di metà buffer, mentre una seconda sessione li legge con il
+reader, risvegliata dal poller. I dati letti vengono confrontati con quelli scritti.
+Il dispositivo indicato deve essere vuoto. Ritorna 0 se la prova ha successo, 1 altrimenti.
+=====================================================================================================
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmflow.h"
+
+#define SMOKE_MESSAGES 100        // Messaggi piccoli scritti tramite il buffer del writer
+#define SMOKE_WRITER_BUFFER 4096  // Buffer del writer, un messaggio più grande della metà viene scritto senza copia
+#define SMOKE_LARGE 3000          // Dimensione del messaggio grande
+#define SMOKE_WAIT_MS 1000        // Attesa massima del poller prima di dichiarare fallita la prova
+
+static char expected[SMOKE_MESSAGES * 16 + SMOKE_LARGE];
+static char received[sizeof(expected)];
+
+/**
+ * Stampa l'errore della funzione 'what' e ritorna 1
+ */
+static int fail(const char *what, long err) {
+    fprintf(stderr, "> libmflow_smoke: %s failed: %s\n", what, strerror((int)-err));
+    return 1;
+}
+
+/**
+ * Scrive i messaggi tramite il writer, ricostruendo in 'expected' lo stream atteso. Ritorna il numero di bytes scritti o -errno.
+ */
+static long write_messages(mflow_session *session) {
+    mflow_writer writer;
+    char msg[16];
+    size_t total = 0;
+    int i, len, ret;
+
+    ret = mflow_writer_init(&writer, session, NULL, SMOKE_WRITER_BUFFER, 1000000);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < SMOKE_MESSAGES && ret == 0; i++) {
+        len = snprintf(msg, sizeof(msg), "msg-%03d\n", i);
+        memcpy(expected + total, msg, len);
+        total += len;
+        ret = mflow_writer_append(&writer, msg, len);
+    }
+    if (ret == 0) {
+        memset(expected + total, 'L', SMOKE_LARGE);
+        total += SMOKE_LARGE;
+        ret = mflow_writer_append(&writer, expected + total - SMOKE_LARGE, SMOKE_LARGE);
+    }
+    if (ret == 0) {
+        ret = mflow_writer_flush(&writer);
+    }
+    printf("> writer: %llu messages in %llu writes\n", (unsigned long long)writer.messages, (unsigned long long)writer.writes);
+    mflow_writer_destroy(&writer);
+    return ret < 0 ? ret : (long)total;
+}
+
+/**
+ * Legge tramite il poller ed il reader fino a 'total' bytes, oppure finché il poller non resta senza eventi per SMOKE_WAIT_MS.
+ * Ritorna il numero di bytes letti o -errno.
+ */
+static long read_messages(mflow_session *session, size_t total) {
+    mflow_poller poller;
+    mflow_reader reader;
+    mflow_event events[1];
+    const void *data;
+    size_t got = 0;
+    ssize_t len = 0;
+    int ret;
+
+    ret = mflow_reader_init(&reader, session, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = mflow_poller_init(&poller);
+    if (ret < 0) {
+        mflow_reader_destroy(&reader);
+        return ret;
+    }
+    ret = mflow_poller_add(&poller, session, EPOLLIN);
+
+    while (ret == 0 && got < total) {
+        ret = mflow_poller_wait(&poller, events, 1, SMOKE_WAIT_MS);
+        if (ret <= 0) {
+            ret = ret == 0 ? -ETIMEDOUT : ret;
+            break;
+        }
+        ret = 0;
+        while (got < total && (len = mflow_reader_next(&reader, &data)) > 0) {
+            if ((size_t)len > total - got) {
+                len = total - got;
+            }
+            memcpy(received + got, data, len);
+            got += len;
+        }
+        if (len < 0 && len != -EAGAIN) {
+            ret = len;
+        }
+    }
+    mflow_poller_close(&poller);
+    mflow_reader_destroy(&reader);
+    return ret < 0 ? ret : (long)got;
+}
+
+int main(int argc, char **argv) {
+    mflow_session writer_session, reader_session;
+    struct mflow_session_params params = {0};
+    int minor = argc > 1 ? atoi(argv[1]) : 0;
+    const char *path = argc > 2 ? argv[2] : NULL;
+    long written, got;
+    int ret;
+
+    if (argc > 3) {
+        printf("> USAGE: ./libmflow_smoke [MINOR] [DEVICE_PATH]\n");
+        return 1;
+    }
+
+    ret = mflow_open(&writer_session, path, minor, O_NONBLOCK);
+    if (ret < 0) {
+        return fail("mflow_open (writer)", ret);
+    }
+    ret = mflow_open(&reader_session, path, minor, O_NONBLOCK);
+    if (ret < 0) {
+        mflow_close(&writer_session);
+        return fail("mflow_open (reader)", ret);
+    }
+
+    // Il writer attende al massimo un secondo il flush, il reader legge tutte le classi di priorità del dispositivo
+    params.mask = MFLOW_PARAM_TIMEOUT;
+    params.timeout_ns = 1000000000ULL;
+    ret = mflow_configure(&writer_session, &params);
+    if (ret == 0) {
+        params.mask = MFLOW_PARAM_READ_MODE;
+        params.read_mode = 1;
+        params.scheduler = 0;
+        ret = mflow_configure(&reader_session, &params);
+    }
+    if (ret < 0) {
+        ret = fail("mflow_configure", ret);
+        goto out;
+    }
+
+    written = write_messages(&writer_session);
+    if (written < 0) {
+        ret = fail("mflow_writer", written);
+        goto out;
+    }
+    ret = mflow_flush(&writer_session);
+    if (ret < 0) {
+        ret = fail("mflow_flush", ret);
+        goto out;
+    }
+
+    got = read_messages(&reader_session, written);
+    if (got < 0) {
+        ret = fail("mflow_reader", got);
+        goto out;
+    }
+    if (got != written || memcmp(expected, received, written) != 0) {
+        fprintf(stderr, "> libmflow_smoke: read %ld/%ld bytes, data mismatch\n", got, written);
+        ret = 1;
+        goto out;
+    }
+    printf("> libmflow_smoke: %ld bytes written and read back correctly\n", written);
+    ret = 0;
+
+out:
+    mflow_close(&reader_session);
+    mflow_close(&writer_session);
+    return ret;
+}
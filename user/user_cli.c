@@ -52,22 +52,31 @@ void clear_buffer() {
  */
 int main(int argc, char** argv) {
     int ret;
-    if (argc != 2 && argc != 3) {
+    if (argc > 3) {
         print_menu_header();
         printf(COLOR_RED BOLD "> Launch error: wrong number of arguments\n" RESET);
-        printf(COLOR_GREEN "> USAGE: sudo ./user_cli MAJOR [DEVICE_PATH].\n" RESET);
+        printf(COLOR_GREEN "> USAGE: sudo ./user_cli [MAJOR] [DEVICE_PATH].\n" RESET);
         return -1;
     }
-    if (isNumber(argv[1])) {
+    if (argc == 1) {
+        // I nodi /dev/mflow-devN vengono creati dal driver, quindi il major può essere letto dal primo nodo
+        major = get_node_major(DEFAULT_DEV_PATH "0");
+        if (major == -1) {
+            print_menu_header();
+            printf(COLOR_RED BOLD "> Launch error: %s0 not found, is the driver loaded?\n" RESET, DEFAULT_DEV_PATH);
+            printf(COLOR_GREEN "> USAGE: sudo ./user_cli [MAJOR] [DEVICE_PATH].\n" RESET);
+            return -1;
+        }
+    } else if (isNumber(argv[1])) {
         major = atoi(argv[1]);
     } else {
         print_menu_header();
         printf(COLOR_RED BOLD "> Launch error: insert a numeric value for MAJOR.\n" RESET);
-        printf(COLOR_GREEN "> USAGE: sudo ./user_cli MAJOR [DEVICE_PATH].\n" RESET);
+        printf(COLOR_GREEN "> USAGE: sudo ./user_cli [MAJOR] [DEVICE_PATH].\n" RESET);
         return -1;
     }
 
-    if (argv[2] == 0) {
+    if (argc < 3) {
         device_path = DEFAULT_DEV_PATH;
     } else {
         device_path = argv[2];
@@ -193,7 +202,7 @@ int open_device() {
     printf("%sDevice %s successfully opened, fd is: %d%s\n", COLOR_GREEN, opened_device, device_fd, RESET);
 
     // Controllo se il file aperto ha un major differente da quello del client
-    opened_major = get_open_major(opened_device);
+    opened_major = get_open_major(device_fd);
     if (opened_major != major) {
         printf("%s%sWarning: currently opened device has major '%d' different than '%d' used by the CLI.%s\n", COLOR_YELLOW, BOLD, opened_major, major, RESET);
         printf("%sChange the Major used by the client to '%d' or recreate the nodes with Major '%d'.%s\n", COLOR_YELLOW, opened_major, major, RESET);
@@ -226,7 +235,7 @@ int write_op() {
 
     res = write(device_fd, data_buff, min(strlen(data_buff), 4096));
     if (res < 0) {
-        printf(COLOR_RED "\nWrite failed, check 'dmesg' for more info.\n" RESET);
+        printf(COLOR_RED "\nWrite failed: %s. Check 'dmesg' for more info.\n" RESET, strerror(errno));
     } else {
         printf("\n%sWrite success, %d bytes have been written on the device.%s\n", COLOR_GREEN, res, RESET);
     }
@@ -265,7 +274,7 @@ int read_op() {
     clear_buffer();
     res = read(device_fd, data_buff, min(amount, 4096));
     if (res < 0) {
-        printf(COLOR_RED "\nRead failed, check 'dmesg' for more info.\n" RESET);
+        printf(COLOR_RED "\nRead failed: %s. Check 'dmesg' for more info.\n" RESET, strerror(errno));
     } else {
         printf("\n%sRead success, %d bytes have been read from the device%s: %s\n\n", COLOR_GREEN, res, RESET, data_buff);
     }
@@ -324,7 +333,8 @@ int show_menu() {
 }
 
 /**
- * Crea 128 nodi con minor 0-127 in /dev
+ * Crea 128 nodi con minor 0-127 in /dev. Il driver crea già i nodi nel path di default, quindi
+ * il comando serve solo per path differenti o per nodi rimossi manualmente.
  */
 int create_nodes() {
     printf("Creating %d minors for device %s with major %d\n", NUM_DEVICES, device_path, major);
@@ -333,9 +343,10 @@ int create_nodes() {
     for (i = 0; i < NUM_DEVICES; i++) {
         sprintf(the_dev, "%s%d", device_path, i);
         if (access(the_dev, F_OK) != 0) {
-            sprintf(data_buff, "mknod %s c %d %i\n", the_dev, major, i);
-            system(data_buff);
-            sprintf(data_buff, "%s%d", device_path, i);
+            if (mknod(the_dev, S_IFCHR | 0644, makedev(major, i)) == -1) {
+                printf(COLOR_RED "Unable to create %s: %s\n" RESET, the_dev, strerror(errno));
+                return -1;
+            }
             n++;
         } else {
             // Il nodo non viene creato se già esiste.
@@ -347,7 +358,8 @@ int create_nodes() {
 }
 
 /**
- * Abilita o disabilita un device file accedendo all'apposito parametro esposto nel VFS
+ * Abilita o disabilita un device file. Se è aperta una sessione si usa la ioctl per-minor del driver,
+ * altrimenti si accede all'apposito parametro esposto nel VFS
  */
 int set_device_enabling(int status) {
     int count = 0;
@@ -388,6 +400,16 @@ int set_device_enabling(int status) {
     minor_cmd = atoi(data_buff);
     clear_buffer();
 
+    if (device_fd != -1) {
+        __u32 ioctl_minor = minor_cmd;
+        if (ioctl(device_fd, status ? MFLOW_IOC_ENABLE_DEV : MFLOW_IOC_DISABLE_DEV, &ioctl_minor) == 0) {
+            fclose(handle);
+            printf(COLOR_GREEN "Device file succesfully %sd.\n" RESET, op);
+            wait_input();
+            return 0;
+        }
+    }
+
     // Scrittura del valore 1/0 nel file device_enabling, alla posizione associata al minor
     getline(&line, &len, handle);
     char s = status + '0';
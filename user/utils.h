@@ -15,8 +15,12 @@ Mantiene funzioni ausiliarie e costanti utilizzati nel client utente.
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include "../driver/utils/mflow_ioctl.h"
+
 // Numero di dispositivi gestibili dal client
 #define NUM_DEVICES 128
 
@@ -156,30 +160,23 @@ int read_param_field(char* file, int minor) {
 /**
  * Ottiene il major number del file attualmente aperto
  */
-int get_open_major(char* opened_device) {
-    char buff[4096];
-    char* line;
-    size_t len = 0;
-
-    sprintf(buff,
-            "ls -l %s | cut -d ' ' -f 5 | sed 's/.$//' > opened_major",
-            opened_device);
-
-    system(buff);
-
-    FILE* ptr;
-    char ch;
-    ptr = fopen("opened_major", "r");
-
-    if (NULL == ptr) {
-        printf("file can't be opened \n");
+int get_open_major(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISCHR(st.st_mode)) {
+        return -1;
     }
+    return major(st.st_rdev);
+}
 
-    getline(&line, &len, ptr);
-    fclose(ptr);
-    system("rm opened_major 1>/dev/null");
-
-    return atoi(line);
+/**
+ * Ottiene il major number del device file nel path indicato, -1 se il nodo non esiste
+ */
+int get_node_major(const char* path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISCHR(st.st_mode)) {
+        return -1;
+    }
+    return major(st.st_rdev);
 }
 
 /**